@@ -0,0 +1,111 @@
+// Times the closed form inverses of geometry.h against the cofactor expansion they replaced, and checks that both
+// agree on random well conditioned matrices. Exits with 1 on a mismatch.
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include "geometry.h"
+
+namespace {
+
+const int MATRICES = 1024; // inverted per timed pass, small enough to stay in the cache
+const int PASSES   = 20;   // the fastest pass is reported
+const int CHECKS   = 10000;
+const float TOLERANCE = 1e-4f; // relative to 1 + |coefficient|
+
+// A copy of the path geometry.h had before the closed forms: the adjugate divided by the determinant, every cofactor
+// being the determinant of a minor expanded recursively along its first row. mat::adjugate() can not stand for it,
+// its cofactors go through the closed form determinants now.
+template <size_t D> mat<D-1,D-1,float> get_minor(const mat<D,D,float> &m, size_t row, size_t col) {
+    mat<D-1,D-1,float> ret;
+    for (size_t i=D-1; i--; )
+        for (size_t j=D-1; j--; ret[i][j]=m[i<row?i:i+1][j<col?j:j+1]);
+    return ret;
+}
+
+template <size_t D> struct Expansion {
+    static float det(const mat<D,D,float> &m) {
+        float ret = 0;
+        for (size_t i=D; i--; ret += m[0][i]*cofactor(m, 0, i));
+        return ret;
+    }
+    static float cofactor(const mat<D,D,float> &m, size_t row, size_t col) {
+        return Expansion<D-1>::det(get_minor(m, row, col))*((row+col)%2 ? -1 : 1);
+    }
+};
+
+template <> struct Expansion<1> {
+    static float det(const mat<1,1,float> &m) { return m[0][0]; }
+};
+
+template <size_t D> mat<D,D,float> cofactor_invert_transpose(const mat<D,D,float> &m) {
+    mat<D,D,float> ret;
+    for (size_t i=D; i--; )
+        for (size_t j=D; j--; ret[i][j]=Expansion<D>::cofactor(m, i, j));
+    return ret/(ret[0]*m[0]);
+}
+
+template <size_t D> struct Cofactor {
+    mat<D,D,float> operator()(const mat<D,D,float> &m) const { return cofactor_invert_transpose(m); }
+};
+
+template <size_t D> struct ClosedForm {
+    mat<D,D,float> operator()(const mat<D,D,float> &m) const { return inv<D,float>::invert_transpose(m); }
+};
+
+template <size_t D> mat<D,D,float> random_matrix(std::mt19937 &gen) {
+    std::uniform_real_distribution<float> coeff(-2.f, 2.f);
+    mat<D,D,float> m;
+    for (size_t i=0; i<D; i++) for (size_t j=0; j<D; j++) m[i][j] = coeff(gen);
+    return m;
+}
+
+template <size_t D> float max_error(const mat<D,D,float> &a, const mat<D,D,float> &b) {
+    float ret = 0.f;
+    for (size_t i=0; i<D; i++) for (size_t j=0; j<D; j++) ret = std::max(ret, std::abs(a[i][j]-b[i][j])/(1.f + std::abs(b[i][j])));
+    return ret;
+}
+
+template <size_t D> bool check(std::mt19937 &gen) {
+    float error = 0.f;
+    for (int k=0; k<CHECKS; k++) {
+        const mat<D,D,float> m = random_matrix<D>(gen);
+        if (std::abs(m.det())<.1f) continue; // too close to singular for float
+        error = std::max(error, max_error(m.invert_transpose(), cofactor_invert_transpose(m)));
+    }
+    std::printf("%zux%zu max relative difference %g\n", D, D, error);
+    return error<=TOLERANCE;
+}
+
+// ns per matrix of the fastest pass, the sum keeps the inverses from being optimized away
+template <size_t D, typename F> double time_ns(const std::vector<mat<D,D,float> > &ms, F invert_transpose, float &sum) {
+    double best = 1e30;
+    for (int p=0; p<PASSES; p++) {
+        const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        for (size_t i=0; i<ms.size(); i++) sum += invert_transpose(ms[i])[1][2];
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+    }
+    return best*1e9/ms.size();
+}
+
+template <size_t D> void bench(std::mt19937 &gen) {
+    std::vector<mat<D,D,float> > ms(MATRICES);
+    for (size_t i=0; i<ms.size(); i++) ms[i] = random_matrix<D>(gen);
+    float sum = 0.f;
+    const double cofactor = time_ns(ms, Cofactor<D>(), sum);
+    const double closed   = time_ns(ms, ClosedForm<D>(), sum);
+    std::printf("%zux%zu invert_transpose: cofactor %.1f ns, inv<%zu> %.1f ns (%g)\n", D, D, cofactor, D, closed, sum);
+}
+
+}
+
+int main() {
+    std::mt19937 gen(1);
+    const bool agree = check<3>(gen) & check<4>(gen);
+    bench<3>(gen);
+    bench<4>(gen);
+    if (!agree) std::printf("the closed forms disagree with the cofactor path\n");
+    return agree ? 0 : 1;
+}
@@ -0,0 +1,11 @@
+CONFIG += c++11 console
+CONFIG -= qt app_bundle
+
+INCLUDEPATH += ..
+
+HEADERS += \
+    ../geometry.h
+
+SOURCES += \
+    bench_inverse.cpp \
+    ../geometry.cpp
@@ -0,0 +1,54 @@
+#include "binner.h"
+#include <algorithm>
+
+Binner::Binner(Vec2i screenSize, int tileSize)
+    : m_screenSize(screenSize)
+    , m_tileCount((screenSize.x + tileSize - 1) / tileSize, (screenSize.y + tileSize - 1) / tileSize)
+    , m_tileSize(tileSize)
+    , m_chunks()
+{
+}
+
+void Binner::reset(int chunks)
+{
+    m_chunks.resize(chunks);
+    for (auto &chunk : m_chunks) {
+        chunk.entries.clear();
+        chunk.bins.resize(get_tile_count());
+        for (auto &bin : chunk.bins) {
+            bin.clear();
+        }
+    }
+}
+
+void Binner::add(int chunk, int face, const Primitive &prim)
+{
+    if (prim.setup.xmax < 0 || prim.setup.ymax < 0 || prim.setup.xmin >= m_screenSize.x || prim.setup.ymin >= m_screenSize.y) {
+        return;
+    }
+    const int tx0 = std::max(prim.setup.xmin, 0) / m_tileSize;
+    const int ty0 = std::max(prim.setup.ymin, 0) / m_tileSize;
+    const int tx1 = std::min(prim.setup.xmax / m_tileSize, m_tileCount.x - 1);
+    const int ty1 = std::min(prim.setup.ymax / m_tileSize, m_tileCount.y - 1);
+    Chunk &c = m_chunks[chunk];
+    const int index = int(c.entries.size());
+    Entry entry = { face, prim };
+    c.entries.push_back(entry);
+    for (int ty = ty0; ty <= ty1; ++ty) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            c.bins[tx + ty * m_tileCount.x].push_back(index);
+        }
+    }
+}
+
+int Binner::get_tile_count() const
+{
+    return m_tileCount.x * m_tileCount.y;
+}
+
+FrameTile Binner::get_tile(int tile) const
+{
+    const Vec2i origin(tile % m_tileCount.x * m_tileSize, tile / m_tileCount.x * m_tileSize);
+    const Vec2i size(std::min(m_tileSize, m_screenSize.x - origin.x), std::min(m_tileSize, m_screenSize.y - origin.y));
+    return FrameTile(origin, size);
+}
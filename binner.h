@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include "our_gl.h"
+
+// Sort-middle binning: each face is transformed and set up once per frame, and the resulting primitives are appended
+// to the bins of the screen tiles their bounding box overlaps; the tiles are then rasterized independently.
+// The geometry is processed in chunks, each chunk having its own storage so that the threads never share anything;
+// walking the chunks in order keeps the submission order of the primitives within every tile.
+class Binner
+{
+public:
+    struct Entry {
+        int face;       // index of the face the primitive comes from
+        Primitive prim;
+    };
+
+    explicit Binner(Vec2i screenSize, int tileSize);
+
+    void reset(int chunks);
+    void add(int chunk, int face, const Primitive &prim);
+
+    int get_tile_count() const;
+    FrameTile get_tile(int tile) const;
+
+    template<class Fn>
+    void for_each(int tile, Fn fn) const
+    {
+        for (auto const& chunk : m_chunks) {
+            for (int i : chunk.bins[tile]) {
+                fn(chunk.entries[i]);
+            }
+        }
+    }
+
+private:
+    struct Chunk {
+        std::vector<Entry> entries;
+        std::vector<std::vector<int> > bins; // per tile, indices of the entries
+    };
+
+    Vec2i m_screenSize;
+    Vec2i m_tileCount;
+    int m_tileSize;
+    std::vector<Chunk> m_chunks;
+};
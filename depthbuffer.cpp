@@ -0,0 +1,38 @@
+#include "depthbuffer.h"
+#include <algorithm>
+#include <limits>
+
+DepthBuffer::DepthBuffer(int width, int height)
+    : m_size(width, height)
+    , m_coarseSize((width + BLOCK_SIZE - 1) / BLOCK_SIZE, (height + BLOCK_SIZE - 1) / BLOCK_SIZE)
+    , m_depth(width * height)
+    , m_coarseDepth(m_coarseSize.x * m_coarseSize.y)
+{
+    clear();
+}
+
+void DepthBuffer::clear()
+{
+    std::fill(m_depth.begin(), m_depth.end(), -std::numeric_limits<float>::max());
+    std::fill(m_coarseDepth.begin(), m_coarseDepth.end(), -std::numeric_limits<float>::max());
+}
+
+Vec2i DepthBuffer::get_size() const
+{
+    return m_size;
+}
+
+Vec2i DepthBuffer::get_coarse_size() const
+{
+    return m_coarseSize;
+}
+
+float *DepthBuffer::buffer()
+{
+    return m_depth.data();
+}
+
+float *DepthBuffer::coarse_buffer()
+{
+    return m_coarseDepth.data();
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+
+// Depth buffer along with its coarse version: one value per BLOCK_SIZE x BLOCK_SIZE block of pixels
+// holding the farthest depth of the block, that allows the rasterizer to reject whole blocks at once.
+class DepthBuffer
+{
+public:
+    static const int BLOCK_SIZE = 8;
+
+    explicit DepthBuffer(int width, int height);
+    void clear();
+
+    Vec2i get_size() const;
+    Vec2i get_coarse_size() const;
+    float *buffer();
+    float *coarse_buffer();
+
+private:
+    Vec2i m_size;
+    Vec2i m_coarseSize;
+    std::vector<float> m_depth;
+    std::vector<float> m_coarseDepth;
+};
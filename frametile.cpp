@@ -1,6 +1,8 @@
 #include "frametile.h"
 #include "tgaimage.h"
 #include <string.h>
+#include <algorithm>
+#include <cassert>
 
 FrameTile::FrameTile(Vec2i origin, Vec2i size)
     : m_origin(origin)
@@ -8,12 +10,17 @@ FrameTile::FrameTile(Vec2i origin, Vec2i size)
 {
 }
 
-void FrameTile::init(TGAImage &image, float *zbuffer)
+void FrameTile::init(TGAImage &image, DepthBuffer &depth, unsigned *ids)
 {
+    // coarse depth blocks are updated by the tile owning them, so they must not straddle tiles
+    assert(m_origin.x % DepthBuffer::BLOCK_SIZE == 0 && m_origin.y % DepthBuffer::BLOCK_SIZE == 0);
     m_imageSize = image.get_size();
     m_data = image.buffer();
     m_bytespp = image.get_bytespp();
-    m_zbuffer = zbuffer;
+    m_zbuffer = depth.buffer();
+    m_coarseZbuffer = depth.coarse_buffer();
+    m_coarseWidth = depth.get_coarse_size().x;
+    m_ids = ids;
 }
 
 TGAColor FrameTile::get(int x, int y) const
@@ -56,6 +63,42 @@ void FrameTile::set_z(int x, int y, float z)
     m_zbuffer[index(x, y)] = z;
 }
 
+float *FrameTile::get_z_ptr(int x, int y)
+{
+    return m_zbuffer + index(x, y);
+}
+
+float FrameTile::get_coarse_z(int x, int y) const
+{
+    return m_coarseZbuffer[x / DepthBuffer::BLOCK_SIZE + y / DepthBuffer::BLOCK_SIZE * m_coarseWidth];
+}
+
+void FrameTile::update_coarse_z(int x, int y)
+{
+    const int x0 = x - x % DepthBuffer::BLOCK_SIZE;
+    const int y0 = y - y % DepthBuffer::BLOCK_SIZE;
+    const int x1 = std::min(x0 + DepthBuffer::BLOCK_SIZE, m_imageSize.x);
+    const int y1 = std::min(y0 + DepthBuffer::BLOCK_SIZE, m_imageSize.y);
+    float farthest = m_zbuffer[index(x0, y0)];
+    for (int j = y0; j < y1; ++j) {
+        const float *row = m_zbuffer + index(0, j);
+        for (int i = x0; i < x1; ++i) {
+            farthest = std::min(farthest, row[i]);
+        }
+    }
+    m_coarseZbuffer[x0 / DepthBuffer::BLOCK_SIZE + y0 / DepthBuffer::BLOCK_SIZE * m_coarseWidth] = farthest;
+}
+
+unsigned FrameTile::get_id(int x, int y) const
+{
+    return m_ids[index(x, y)];
+}
+
+unsigned *FrameTile::get_id_ptr(int x, int y)
+{
+    return m_ids + index(x, y);
+}
+
 size_t FrameTile::index(int x, int y) const
 {
     return x + y * m_imageSize.x;
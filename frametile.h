@@ -2,12 +2,13 @@
 
 #include "geometry.h"
 #include "tgaimage.h"
+#include "depthbuffer.h"
 
 class FrameTile
 {
 public:
     explicit FrameTile(Vec2i origin, Vec2i size);
-    void init(TGAImage &image, float *zbuffer);
+    void init(TGAImage &image, DepthBuffer &depth, unsigned *ids = nullptr);
 
     TGAColor get(int x, int y) const;
     void set(int x, int y, const TGAColor &c);
@@ -19,6 +20,15 @@ public:
 
     float get_z(int x, int y) const;
     void set_z(int x, int y, float z);
+    float *get_z_ptr(int x, int y); // depth of one pixel in place, the vectorized rasterizer gathers and scatters its lanes through it
+
+    // farthest depth of the DepthBuffer::BLOCK_SIZE block containing the pixel (x, y)
+    float get_coarse_z(int x, int y) const;
+    void update_coarse_z(int x, int y);
+
+    // visibility buffer, ids of the triangles covering the pixels
+    unsigned get_id(int x, int y) const;
+    unsigned *get_id_ptr(int x, int y);
 
 private:
     inline size_t index(int x, int y) const;
@@ -29,4 +39,7 @@ private:
     unsigned char* m_data = nullptr;
     int m_bytespp = 0;
     float *m_zbuffer = nullptr;
+    float *m_coarseZbuffer = nullptr;
+    int m_coarseWidth = 0;
+    unsigned *m_ids = nullptr;
 };
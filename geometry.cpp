@@ -1,7 +1,46 @@
 #include "geometry.h"
+#include "simd.h"
+#include "threadpool.h"
+#include <algorithm>
 
 template <> template <> vec<3,int>  ::vec(const vec<3,float> &v) : x(int(v.x+.5f)),y(int(v.y+.5f)),z(int(v.z+.5f)) {}
 template <> template <> vec<3,float>::vec(const vec<3,int> &v)   : x(v.x),y(v.y),z(v.z) {}
 template <> template <> vec<2,int>  ::vec(const vec<2,float> &v) : x(int(v.x+.5f)),y(int(v.y+.5f)) {}
 template <> template <> vec<2,float>::vec(const vec<2,int> &v)   : x(v.x),y(v.y) {}
 
+
+/////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+const int POINTS_PER_TASK = 16384; // batches up to that size are transformed on the calling thread
+
+// the products are summed pairwise, as Matrix*Vec4f does, so that both give the same results
+void transform_range(const Matrix &m, const Vec3fStream &in, Vec4fStream &out, int begin, int end) {
+    vfloat r[4][4];
+    for (int i=0; i<4; i++)
+        for (int j=0; j<4; j++) r[i][j] = vfloat(m[i][j]);
+    float *dst[4] = { out.x.data(), out.y.data(), out.z.data(), out.w.data() };
+    int k = begin;
+    for (; k+SIMD_WIDTH<=end; k+=SIMD_WIDTH) {
+        const vfloat x = vfloat::load(&in.x[k]), y = vfloat::load(&in.y[k]), z = vfloat::load(&in.z[k]);
+        for (int i=0; i<4; i++) ((r[i][0]*x + r[i][1]*y) + (r[i][2]*z + r[i][3])).store(dst[i]+k);
+    }
+    for (; k<end; k++) {
+        for (int i=0; i<4; i++) dst[i][k] = (m[i][0]*in.x[k] + m[i][1]*in.y[k]) + (m[i][2]*in.z[k] + m[i][3]);
+    }
+}
+
+}
+
+void transform_points(const Matrix &m, const Vec3fStream &in, Vec4fStream &out, int n, ThreadPool *pool) {
+    out.resize(n);
+    if (!pool || n<=POINTS_PER_TASK) {
+        transform_range(m, in, out, 0, n);
+        return;
+    }
+    for (int begin=0; begin<n; begin+=POINTS_PER_TASK) {
+        pool->runAsync(transform_range, std::cref(m), std::cref(in), std::ref(out), begin, std::min(begin+POINTS_PER_TASK, n));
+    }
+    pool->wait();
+}
@@ -5,6 +5,12 @@
 #include <cassert>
 #include <iostream>
 
+// Vec4f and Matrix get 4-wide SSE arithmetics where the target has it, plain loops elsewhere
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#include <emmintrin.h>
+#define GEOMETRY_SSE
+#endif
+
 template<size_t DimCols,size_t DimRows,typename T> class mat;
 
 template <size_t DIM, typename T> struct vec {
@@ -43,6 +49,22 @@ template <typename T> struct vec<3,T> {
 
 /////////////////////////////////////////////////////////////////////////////////
 
+// aligned so that the rows of a Matrix fall on 16 byte boundaries; the loads stay unaligned as operator new of
+// C++11 does not honour the alignment everywhere
+template <> struct alignas(16) vec<4,float> {
+    vec() { for (size_t i=4; i--; data_[i] = 0.f); }
+          float& operator[](const size_t i)       { assert(i<4); return data_[i]; }
+    const float& operator[](const size_t i) const { assert(i<4); return data_[i]; }
+#ifdef GEOMETRY_SSE
+    explicit vec(__m128 v) { _mm_storeu_ps(data_, v); }
+    __m128 m128() const { return _mm_loadu_ps(data_); }
+#endif
+private:
+    float data_[4];
+};
+
+/////////////////////////////////////////////////////////////////////////////////
+
 template<size_t DIM,typename T> T operator*(const vec<DIM,T>& lhs, const vec<DIM,T>& rhs) {
     T ret = T();
     for (size_t i=DIM; i--; ret+=lhs[i]*rhs[i]);
@@ -82,6 +104,35 @@ template<size_t LEN,size_t DIM, typename T> vec<LEN,T> proj(const vec<DIM,T> &v)
     return ret;
 }
 
+#ifdef GEOMETRY_SSE
+// the non-template overloads take precedence over the generic loops above
+
+inline float hsum(__m128 v) {
+    const __m128 pairs = _mm_add_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2,3,0,1)));
+    return _mm_cvtss_f32(_mm_add_ss(pairs, _mm_movehl_ps(pairs, pairs)));
+}
+
+inline float operator*(const vec<4,float>& lhs, const vec<4,float>& rhs) {
+    return hsum(_mm_mul_ps(lhs.m128(), rhs.m128()));
+}
+
+inline vec<4,float> operator+(const vec<4,float>& lhs, const vec<4,float>& rhs) {
+    return vec<4,float>(_mm_add_ps(lhs.m128(), rhs.m128()));
+}
+
+inline vec<4,float> operator-(const vec<4,float>& lhs, const vec<4,float>& rhs) {
+    return vec<4,float>(_mm_sub_ps(lhs.m128(), rhs.m128()));
+}
+
+inline vec<4,float> operator*(const vec<4,float>& lhs, float rhs) {
+    return vec<4,float>(_mm_mul_ps(lhs.m128(), _mm_set1_ps(rhs)));
+}
+
+inline vec<4,float> operator/(const vec<4,float>& lhs, float rhs) {
+    return vec<4,float>(_mm_div_ps(lhs.m128(), _mm_set1_ps(rhs)));
+}
+#endif
+
 template <typename T> vec<3,T> cross(vec<3,T> v1, vec<3,T> v2) {
     return vec<3,T>(v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x);
 }
@@ -109,6 +160,107 @@ template<typename T> struct dt<1,T> {
     }
 };
 
+// closed forms for the sizes the renderer works with, the cofactor recursion above is left to the others
+template<typename T> struct dt<2,T> {
+    static T det(const mat<2,2,T>& m) {
+        return m[0][0]*m[1][1] - m[0][1]*m[1][0];
+    }
+};
+
+template<typename T> struct dt<3,T> {
+    static T det(const mat<3,3,T>& m) {
+        return m[0]*cross(m[1], m[2]);
+    }
+};
+
+template<typename T> struct dt<4,T> {
+    static T det(const mat<4,4,T>& m) {
+        const T s0 = m[0][0]*m[1][1] - m[1][0]*m[0][1], s1 = m[0][0]*m[1][2] - m[1][0]*m[0][2];
+        const T s2 = m[0][0]*m[1][3] - m[1][0]*m[0][3], s3 = m[0][1]*m[1][2] - m[1][1]*m[0][2];
+        const T s4 = m[0][1]*m[1][3] - m[1][1]*m[0][3], s5 = m[0][2]*m[1][3] - m[1][2]*m[0][3];
+        const T c0 = m[2][0]*m[3][1] - m[3][0]*m[2][1], c1 = m[2][0]*m[3][2] - m[3][0]*m[2][2];
+        const T c2 = m[2][0]*m[3][3] - m[3][0]*m[2][3], c3 = m[2][1]*m[3][2] - m[3][1]*m[2][2];
+        const T c4 = m[2][1]*m[3][3] - m[3][1]*m[2][3], c5 = m[2][2]*m[3][3] - m[3][2]*m[2][3];
+        return s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0;
+    }
+};
+
+/////////////////////////////////////////////////////////////////////////////////
+
+template<size_t DIM,typename T> struct inv {
+    static mat<DIM,DIM,T> invert_transpose(const mat<DIM,DIM,T>& src) {
+        mat<DIM,DIM,T> ret = src.adjugate();
+        T tmp = ret[0]*src[0];
+        return ret/tmp;
+    }
+    static mat<DIM,DIM,T> invert(const mat<DIM,DIM,T>& src) {
+        return invert_transpose(src).transpose();
+    }
+};
+
+template<typename T> struct inv<2,T> {
+    static mat<2,2,T> invert(const mat<2,2,T>& m) {
+        const T rdet = T(1)/dt<2,T>::det(m);
+        mat<2,2,T> ret;
+        ret[0][0] =  m[1][1]*rdet; ret[0][1] = -m[0][1]*rdet;
+        ret[1][0] = -m[1][0]*rdet; ret[1][1] =  m[0][0]*rdet;
+        return ret;
+    }
+    static mat<2,2,T> invert_transpose(const mat<2,2,T>& m) {
+        return invert(m).transpose();
+    }
+};
+
+// the cofactor rows of a 3x3 matrix are the cross products of its other two rows
+template<typename T> struct inv<3,T> {
+    static mat<3,3,T> invert_transpose(const mat<3,3,T>& m) {
+        mat<3,3,T> ret;
+        ret[0] = cross(m[1], m[2]);
+        ret[1] = cross(m[2], m[0]);
+        ret[2] = cross(m[0], m[1]);
+        const T rdet = T(1)/(m[0]*ret[0]);
+        for (size_t i=3; i--; ret[i] = ret[i]*rdet);
+        return ret;
+    }
+    static mat<3,3,T> invert(const mat<3,3,T>& m) {
+        return invert_transpose(m).transpose();
+    }
+};
+
+// the 2x2 determinants of the two upper rows (s) and of the two lower ones (c) are shared by all the cofactors
+template<typename T> struct inv<4,T> {
+    static mat<4,4,T> invert(const mat<4,4,T>& m) {
+        const T s0 = m[0][0]*m[1][1] - m[1][0]*m[0][1], s1 = m[0][0]*m[1][2] - m[1][0]*m[0][2];
+        const T s2 = m[0][0]*m[1][3] - m[1][0]*m[0][3], s3 = m[0][1]*m[1][2] - m[1][1]*m[0][2];
+        const T s4 = m[0][1]*m[1][3] - m[1][1]*m[0][3], s5 = m[0][2]*m[1][3] - m[1][2]*m[0][3];
+        const T c0 = m[2][0]*m[3][1] - m[3][0]*m[2][1], c1 = m[2][0]*m[3][2] - m[3][0]*m[2][2];
+        const T c2 = m[2][0]*m[3][3] - m[3][0]*m[2][3], c3 = m[2][1]*m[3][2] - m[3][1]*m[2][2];
+        const T c4 = m[2][1]*m[3][3] - m[3][1]*m[2][3], c5 = m[2][2]*m[3][3] - m[3][2]*m[2][3];
+        const T rdet = T(1)/(s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0);
+        mat<4,4,T> ret;
+        ret[0][0] = ( m[1][1]*c5 - m[1][2]*c4 + m[1][3]*c3)*rdet;
+        ret[0][1] = (-m[0][1]*c5 + m[0][2]*c4 - m[0][3]*c3)*rdet;
+        ret[0][2] = ( m[3][1]*s5 - m[3][2]*s4 + m[3][3]*s3)*rdet;
+        ret[0][3] = (-m[2][1]*s5 + m[2][2]*s4 - m[2][3]*s3)*rdet;
+        ret[1][0] = (-m[1][0]*c5 + m[1][2]*c2 - m[1][3]*c1)*rdet;
+        ret[1][1] = ( m[0][0]*c5 - m[0][2]*c2 + m[0][3]*c1)*rdet;
+        ret[1][2] = (-m[3][0]*s5 + m[3][2]*s2 - m[3][3]*s1)*rdet;
+        ret[1][3] = ( m[2][0]*s5 - m[2][2]*s2 + m[2][3]*s1)*rdet;
+        ret[2][0] = ( m[1][0]*c4 - m[1][1]*c2 + m[1][3]*c0)*rdet;
+        ret[2][1] = (-m[0][0]*c4 + m[0][1]*c2 - m[0][3]*c0)*rdet;
+        ret[2][2] = ( m[3][0]*s4 - m[3][1]*s2 + m[3][3]*s0)*rdet;
+        ret[2][3] = (-m[2][0]*s4 + m[2][1]*s2 - m[2][3]*s0)*rdet;
+        ret[3][0] = (-m[1][0]*c3 + m[1][1]*c1 - m[1][2]*c0)*rdet;
+        ret[3][1] = ( m[0][0]*c3 - m[0][1]*c1 + m[0][2]*c0)*rdet;
+        ret[3][2] = (-m[3][0]*s3 + m[3][1]*s1 - m[3][2]*s0)*rdet;
+        ret[3][3] = ( m[2][0]*s3 - m[2][1]*s1 + m[2][2]*s0)*rdet;
+        return ret;
+    }
+    static mat<4,4,T> invert_transpose(const mat<4,4,T>& m) {
+        return invert(m).transpose();
+    }
+};
+
 /////////////////////////////////////////////////////////////////////////////////
 
 template<size_t DimRows,size_t DimCols,typename T> class mat {
@@ -167,17 +319,15 @@ public:
         return ret;
     }
 
-    mat<DimRows,DimCols,T> invert_transpose() {
-        mat<DimRows,DimCols,T> ret = adjugate();
-        T tmp = ret[0]*rows[0];
-        return ret/tmp;
+    mat<DimRows,DimCols,T> invert_transpose() const {
+        return inv<DimCols,T>::invert_transpose(*this);
     }
 
-    mat<DimRows,DimCols,T> invert() {
-        return invert_transpose().transpose();
+    mat<DimRows,DimCols,T> invert() const {
+        return inv<DimCols,T>::invert(*this);
     }
 
-    mat<DimCols,DimRows,T> transpose() {
+    mat<DimCols,DimRows,T> transpose() const {
         mat<DimCols,DimRows,T> ret;
         for (size_t i=DimCols; i--; ret[i]=this->col(i));
         return ret;
@@ -204,6 +354,28 @@ template<size_t DimRows,size_t DimCols,typename T>mat<DimCols,DimRows,T> operato
     return lhs;
 }
 
+#ifdef GEOMETRY_SSE
+inline mat<4,4,float> operator*(const mat<4,4,float>& lhs, const mat<4,4,float>& rhs) {
+    const __m128 r[4] = { rhs[0].m128(), rhs[1].m128(), rhs[2].m128(), rhs[3].m128() };
+    mat<4,4,float> result;
+    for (size_t i=4; i--; ) {
+        const vec<4,float>& l = lhs[i];
+        result[i] = vec<4,float>(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(l[0]), r[0]), _mm_mul_ps(_mm_set1_ps(l[1]), r[1])),
+                                            _mm_add_ps(_mm_mul_ps(_mm_set1_ps(l[2]), r[2]), _mm_mul_ps(_mm_set1_ps(l[3]), r[3]))));
+    }
+    return result;
+}
+
+// the four row products are transposed so that the dot products come out as one vertical sum
+inline vec<4,float> operator*(const mat<4,4,float>& lhs, const vec<4,float>& rhs) {
+    const __m128 v = rhs.m128();
+    __m128 p0 = _mm_mul_ps(lhs[0].m128(), v), p1 = _mm_mul_ps(lhs[1].m128(), v);
+    __m128 p2 = _mm_mul_ps(lhs[2].m128(), v), p3 = _mm_mul_ps(lhs[3].m128(), v);
+    _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+    return vec<4,float>(_mm_add_ps(_mm_add_ps(p0, p1), _mm_add_ps(p2, p3)));
+}
+#endif
+
 template <size_t DimRows,size_t DimCols,class T> std::ostream& operator<<(std::ostream& out, mat<DimRows,DimCols,T>& m) {
     for (size_t i=0; i<DimRows; i++) out << m[i] << std::endl;
     return out;
@@ -217,5 +389,31 @@ typedef vec<3,  float> Vec3f;
 typedef vec<3,  int>   Vec3i;
 typedef vec<4,  float> Vec4f;
 typedef mat<4,4,float> Matrix;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+class ThreadPool;
+
+// points stored component by component, so that consecutive points fill the lanes of a SIMD register
+struct Vec3fStream {
+    void resize(size_t n) { x.resize(n); y.resize(n); z.resize(n); }
+    void push_back(const Vec3f &v) { x.push_back(v.x); y.push_back(v.y); z.push_back(v.z); }
+    size_t size() const { return x.size(); }
+    Vec3f operator[](size_t i) const { return Vec3f(x[i], y[i], z[i]); }
+
+    std::vector<float> x, y, z;
+};
+
+struct Vec4fStream {
+    void resize(size_t n) { x.resize(n); y.resize(n); z.resize(n); w.resize(n); }
+    size_t size() const { return x.size(); }
+    Vec4f operator[](size_t i) const { Vec4f v; v[0] = x[i]; v[1] = y[i]; v[2] = z[i]; v[3] = w[i]; return v; }
+
+    std::vector<float> x, y, z, w;
+};
+
+// out[i] = m*embed<4>(in[i]) for the first n points, out being resized to n; big batches are split over the pool if
+// any, the call then waits for the pool to be idle
+void transform_points(const Matrix &m, const Vec3fStream &in, Vec4fStream &out, int n, ThreadPool *pool = nullptr);
 #endif //__GEOMETRY_H__
 
@@ -1,19 +1,28 @@
 #include <vector>
+#include <algorithm>
 #include <limits>
 #include <memory>
 #include <iostream>
+#include <chrono>
+#include <cstring>
 #include "tgaimage.h"
 #include "model.h"
 #include "geometry.h"
+#include "depthbuffer.h"
+#include "binner.h"
 #include "our_gl.h"
 #include "shader.h"
 #include "sdlwindow.h"
 #include <SDL2/SDL.h>
 #include "threadpool.h"
-#include <windows.h>
 
 const int WIDTH  = 800;
 const int HEIGHT = 800;
+const bool VISIBILITY_BUFFER = true; // rasterize triangle ids first, then shade each visible pixel once
+const bool COMPRESSED_TEXTURES = false; // BC1 diffuse and BC5 normal maps: 4-6x less memory, slower sampling
+const int TILE_SIZE = 64;            // screen tiles rasterized independently, a multiple of DepthBuffer::BLOCK_SIZE
+const int GEOMETRY_CHUNKS = 16;      // batches of faces sent to the thread pool by the geometry pass
+const int BENCH_FRAMES = 64;         // eye angles of the --bench sweep, evenly spread over a full turn
 
 Vec3f LIGHT_DIR(1,1,1);
 Vec3f       EYE(1,1,3);
@@ -23,10 +32,8 @@ Vec3f        UP(0,1,0);
 typedef std::shared_ptr<Model> ModelPtr;
 typedef std::vector<ModelPtr> ModelPtrArray;
 
-Vec3f get_rotated_eye()
+Vec3f get_rotated_eye(float angle)
 {
-    float secondsSinceStart = 0.001f * float(SDL_GetTicks());
-    float angle = 0.5f * secondsSinceStart;
     Matrix rotation = Matrix::identity();
     rotation[0][0] = cos(angle);
     rotation[1][0] = -sin(angle);
@@ -36,80 +43,238 @@ Vec3f get_rotated_eye()
     return proj<3>(rotated);
 }
 
-void draw_3d_model_tile(Model &model, FrameTile &frame)
+Vec3f get_rotated_eye()
+{
+    float secondsSinceStart = 0.001f * float(SDL_GetTicks());
+    return get_rotated_eye(0.5f * secondsSinceStart);
+}
+
+// geometry produced once per frame and consumed by the raster and shading passes
+struct FrameGeometry
+{
+    explicit FrameGeometry(Vec2i screenSize) : uniforms(), clip(), binner(screenSize, TILE_SIZE), shaders() {}
+
+    Uniforms uniforms;
+    std::vector<Vec4fStream> clip; // per model, the clip coordinates of its vertices
+    Binner binner;
+    std::vector<Shader> shaders; // per face of the scene, the varyings written by the vertex shader
+};
+
+// transforms the faces [begin, end) of the scene, the faces being numbered across all the models
+void process_geometry(ModelPtrArray const& models, int chunk, int begin, int end, FrameGeometry &geometry)
+{
+    Shader shader;
+    shader.pUniforms = &geometry.uniforms;
+    Primitive prims[MAX_PRIMITIVES];
+    long long culled[3] = {0, 0, 0};
+    int first = 0;
+    for (size_t m = 0; m < models.size() && first < end; ++m) {
+        Model &model = *models[m];
+        shader.pModel = &model;
+        shader.pClip = &geometry.clip[m];
+        const int to = std::min(end - first, model.nfaces());
+        for (int i = std::max(begin - first, 0); i < to; i++) {
+            for (int j=0; j<3; j++) {
+                shader.vertex(i, j);
+            }
+            const Culling culling = cull(shader.varying_tri, Vec2i(WIDTH, HEIGHT));
+            culled[culling]++;
+            if (culling != CULL_NONE) {
+                continue;
+            }
+            const int face = first + i;
+            shader.setup();
+            geometry.shaders[face] = shader;
+            const int count = assemble(shader.varying_tri, prims);
+            for (int p = 0; p < count; ++p) {
+                geometry.binner.add(chunk, face, prims[p]);
+            }
+        }
+        first += model.nfaces();
+    }
+    primitive_stats.add(end - begin, culled[CULL_BACKFACE], culled[CULL_OUTSIDE]);
+}
+
+void rasterize_tile(FrameGeometry const& geometry, int tile, FrameTile &frame)
+{
+    geometry.binner.for_each(tile, [&](Binner::Entry const& entry) {
+        if (VISIBILITY_BUFFER) {
+            rasterize(entry.prim, unsigned(entry.face + 1), frame); // 0 means no triangle
+        } else {
+            Shader shader = geometry.shaders[entry.face];
+            rasterize(entry.prim, shader, frame);
+        }
+    });
+}
+
+// reconstructs the barycentric coordinates of the visible pixels and shades each of them once; the pixels are walked
+// in batches of 2x2 quads, each triangle present in a batch is shaded with the rest of the quads as helper lanes
+void shade_visibility_tile(FrameGeometry const& geometry, FrameTile &frame)
 {
     Shader shader;
-    shader.setLightDirection(LIGHT_DIR);
-    shader.pModel = &model;
-    for (int i=0; i<model.nfaces(); i++) {
-        for (int j=0; j<3; j++) {
-            shader.vertex(i, j);
+    PixelBarycentrics barycentrics;
+    unsigned current = 0;
+    bool valid = false;
+    const int batchWidth = lane_x(FRAGMENT_BATCH - 1) + 1;
+    unsigned ids[FRAGMENT_BATCH];
+    float bar[3][FRAGMENT_BATCH];
+    unsigned colors[FRAGMENT_BATCH];
+    for (int y = frame.get_top(); y < frame.get_bottom(); y += 2) {
+        for (int x = frame.get_left(); x < frame.get_right(); x += batchWidth) {
+            int pending = 0;
+            for (int l = 0; l < FRAGMENT_BATCH; ++l) {
+                const int px = x + lane_x(l), py = y + lane_y(l);
+                ids[l] = px < frame.get_right() && py < frame.get_bottom() ? frame.get_id(px, py) : 0;
+                if (ids[l]) pending |= 1 << l;
+            }
+            while (pending) {
+                int first = 0;
+                while (!(pending >> first & 1)) ++first;
+                const unsigned id = ids[first];
+                int mask = 0;
+                for (int l = first; l < FRAGMENT_BATCH; ++l) {
+                    if (ids[l] == id) mask |= 1 << l;
+                }
+                pending &= ~mask;
+                if (id != current) {
+                    current = id;
+                    shader = geometry.shaders[id - 1];
+                    valid = barycentrics.init(shader.varying_tri);
+                }
+                if (!valid) {
+                    continue;
+                }
+                for (int l = 0; l < FRAGMENT_BATCH; ++l) {
+                    const Vec3f b = barycentrics.at(x + lane_x(l), y + lane_y(l));
+                    for (int i=0; i<3; i++) bar[i][l] = b[i];
+                }
+                const int written = shader.fragments(mask, bar, colors);
+                for (int l = 0; l < FRAGMENT_BATCH; ++l) {
+                    if (written >> l & 1) frame.set(x + lane_x(l), y + lane_y(l), unpack_color(colors[l]));
+                }
+            }
         }
-        triangle(shader.varying_tri, shader, frame);
     }
 }
 
-void draw_3d_model_simple(ModelPtrArray const& models, TGAImage &frame, float *zbuffer, ThreadPool &threadPool)
+void draw_3d_model_simple(ModelPtrArray const& models, TGAImage &frame, DepthBuffer &depth, unsigned *ids, FrameGeometry &geometry, ThreadPool &threadPool)
 {
-    const int width1 = frame.get_width() / 2;
-    const int width2 = frame.get_width() - width1;
-    const int height1 = frame.get_height() / 2;
-    const int height2 = frame.get_height() - height1;
-
-    FrameTile tile1(Vec2i(0, 0), Vec2i(width1, height1));
-    FrameTile tile2(Vec2i(width1, 0), Vec2i(width2, height1));
-    FrameTile tile3(Vec2i(0, height1), Vec2i(width2, height2));
-    FrameTile tile4(Vec2i(width1, height1), Vec2i(width2, height2));
-    tile1.init(frame, zbuffer);
-    tile2.init(frame, zbuffer);
-    tile3.init(frame, zbuffer);
-    tile4.init(frame, zbuffer);
-
-    for (auto const& pModel : models) {
-        threadPool.runAsync(draw_3d_model_tile, *pModel, tile1);
-        threadPool.runAsync(draw_3d_model_tile, *pModel, tile2);
-        threadPool.runAsync(draw_3d_model_tile, *pModel, tile3);
-        threadPool.runAsync(draw_3d_model_tile, *pModel, tile4);
+    int faces = 0;
+    for (auto const& model : models) {
+        faces += model->nfaces();
+    }
+    geometry.shaders.resize(faces);
+    geometry.uniforms.init(LIGHT_DIR);
+
+    // the vertices are transformed in one pass over each model, the faces then only gather the results
+    const Matrix mvp = geometry.uniforms.mvp.matrix();
+    geometry.clip.resize(models.size());
+    for (size_t m = 0; m < models.size(); ++m) {
+        transform_points(mvp, models[m]->verts(), geometry.clip[m], models[m]->nverts(), &threadPool);
+    }
+
+    // every face goes through the vertex shader once, whatever the number of tiles it covers
+    const int chunkSize = std::max((faces + GEOMETRY_CHUNKS - 1) / GEOMETRY_CHUNKS, 1);
+    const int chunks = (faces + chunkSize - 1) / chunkSize;
+    geometry.binner.reset(chunks);
+    for (int c = 0; c < chunks; ++c) {
+        threadPool.runAsync(process_geometry, std::cref(models), c, c * chunkSize, std::min((c + 1) * chunkSize, faces), std::ref(geometry));
+    }
+    threadPool.wait();
+
+    const int tileCount = geometry.binner.get_tile_count();
+    std::vector<FrameTile> tiles;
+    tiles.reserve(tileCount);
+    for (int t = 0; t < tileCount; ++t) {
+        tiles.push_back(geometry.binner.get_tile(t));
+        tiles.back().init(frame, depth, ids);
+    }
+    for (int t = 0; t < tileCount; ++t) {
+        threadPool.runAsync(rasterize_tile, std::cref(geometry), t, std::ref(tiles[t]));
+    }
+    threadPool.wait();
+
+    if (VISIBILITY_BUFFER) {
+        for (int t = 0; t < tileCount; ++t) {
+            threadPool.runAsync(shade_visibility_tile, std::cref(geometry), std::ref(tiles[t]));
+        }
+        threadPool.wait();
     }
-    while (!threadPool.IsEmpty())
-    {
-        Sleep(0);
+}
+
+// draws the scene seen from eye into freshly cleared buffers
+void render_frame(ModelPtrArray const& models, Vec3f eye, TGAImage &frame, DepthBuffer &depth, std::vector<unsigned> &visibility, FrameGeometry &geometry, ThreadPool &threadPool)
+{
+    frame.clear();
+    depth.clear();
+    std::fill(visibility.begin(), visibility.end(), 0);
+    lookat(eye, CENTER, UP);
+    viewport(WIDTH/8, HEIGHT/8, WIDTH*3/4, HEIGHT*3/4);
+    projection(-1.f/(eye-CENTER).norm());
+    draw_3d_model_simple(models, frame, depth, visibility.data(), geometry, threadPool);
+}
+
+// renders the same sweep of eye angles whatever the build, without a window, so that builds can be compared,
+// e.g. the texel layouts given by TEXTURE_TILE_BITS
+void bench(ModelPtrArray const& models, ThreadPool &threadPool)
+{
+    TGAImage frame(WIDTH, HEIGHT, TGAImage::RGB);
+    DepthBuffer depth(WIDTH, HEIGHT);
+    std::vector<unsigned> visibility(WIDTH*HEIGHT);
+    FrameGeometry geometry(Vec2i(WIDTH, HEIGHT));
+
+    render_frame(models, get_rotated_eye(0.f), frame, depth, visibility, geometry, threadPool); // warms the caches up
+    const auto start = std::chrono::steady_clock::now();
+    for (int f = 0; f < BENCH_FRAMES; ++f) {
+        const float angle = 6.2831853f * float(f) / float(BENCH_FRAMES);
+        render_frame(models, get_rotated_eye(angle), frame, depth, visibility, geometry, threadPool);
     }
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "texture tiles of " << Texture::TILE << "x" << Texture::TILE << " texels: " << ms / BENCH_FRAMES
+              << " ms per frame over " << BENCH_FRAMES << " eye angles" << std::endl;
 }
 
 int qMain(int argc, char** argv) {
     ThreadPool threadPool(4);
 
-    if (2>argc) {
-        std::cerr << "Usage: " << argv[0] << " obj/model.obj" << std::endl;
+    const bool benchmark = argc > 1 && !std::strcmp(argv[1], "--bench");
+    const int firstModel = benchmark ? 2 : 1;
+    if (firstModel+1>argc) {
+        std::cerr << "Usage: " << argv[0] << " [--bench] obj/model.obj" << std::endl;
         return 1;
     }
     ModelPtrArray models;
-    for (int m=1; m<argc; m++) {
+    for (int m=firstModel; m<argc; m++) {
         const char *filePath = argv[m];
-        models.push_back(std::make_shared<Model>(filePath));
+        models.push_back(std::make_shared<Model>(filePath, &threadPool, COMPRESSED_TEXTURES));
+        std::cerr << "# texture memory " << models.back()->texture_memory() / 1024 << " KiB" << std::endl;
+    }
+
+    if (benchmark) {
+        bench(models, threadPool);
+        std::cerr << primitive_stats << std::endl;
+        std::cerr << raster_stats << std::endl;
+        return 0;
     }
 
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS);
 
-    std::unique_ptr<float[]> zbuffer(new float[WIDTH*HEIGHT]);
+    DepthBuffer depth(WIDTH, HEIGHT);
+    std::vector<unsigned> visibility(WIDTH*HEIGHT);
+    FrameGeometry geometry(Vec2i(WIDTH, HEIGHT));
 
     SDLWindow window(WIDTH, HEIGHT);
     std::shared_ptr<TGAImage> pFrame;
     window.swapBuffers(pFrame);
     window.do_on_idle([&]() {
-        pFrame->clear();
-        for (int i=WIDTH*HEIGHT; i--; zbuffer[i] = -std::numeric_limits<float>::max());
-        Vec3f eye = get_rotated_eye();
-        lookat(eye, CENTER, UP);
-        viewport(WIDTH/8, HEIGHT/8, WIDTH*3/4, HEIGHT*3/4);
-        projection(-1.f/(eye-CENTER).norm());
-        draw_3d_model_simple(models, *pFrame, zbuffer.get(), threadPool);
+        render_frame(models, get_rotated_eye(), *pFrame, depth, visibility, geometry, threadPool);
         pFrame->flip_vertically(); // to place the origin in the bottom left corner of the image
         window.swapBuffers(pFrame);
     });
     window.show();
     window.wait_for_closed();
+    std::cerr << primitive_stats << std::endl;
+    std::cerr << raster_stats << std::endl;
 
     return 0;
 }
@@ -1,47 +1,284 @@
 #include <iostream>
-#include <fstream>
-#include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <algorithm>
 #include "model.h"
 
-Model::Model(const char *filename) : verts_(), faces_(), norms_(), uv_(), diffusemap_(), normalmap_(), specularmap_() {
-    std::ifstream in;
-    in.open (filename, std::ifstream::in);
-    if (in.fail()) return;
-    std::string line;
-    while (!in.eof()) {
-        std::getline(in, line);
-        std::istringstream iss(line.c_str());
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// the whole file mapped read-only in memory, empty if it cannot be opened
+class MappedFile {
+public:
+    explicit MappedFile(const char *filename);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile &operator=(const MappedFile&) = delete;
+
+    bool is_open() const { return open_; }
+    const char *begin() const { return data_; }
+    const char *end() const { return data_ + size_; }
+
+private:
+    bool open_;
+    const char *data_;
+    size_t size_;
+#ifdef _WIN32
+    HANDLE file_;
+    HANDLE mapping_;
+#endif
+};
+
+#ifdef _WIN32
+MappedFile::MappedFile(const char *filename) : open_(false), data_(nullptr), size_(0), file_(INVALID_HANDLE_VALUE), mapping_(nullptr) {
+    file_ = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE) return;
+    open_ = true;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) return;
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_) return;
+    data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    if (data_) size_ = size_t(size.QuadPart);
+}
+
+MappedFile::~MappedFile() {
+    if (data_) UnmapViewOfFile(data_);
+    if (mapping_) CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+}
+#else
+MappedFile::MappedFile(const char *filename) : open_(false), data_(nullptr), size_(0) {
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) return;
+    open_ = true;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            data_ = static_cast<const char*>(p);
+            size_ = size_t(st.st_size);
+            madvise(p, size_, MADV_SEQUENTIAL);
+        }
+    }
+    close(fd); // the mapping stays valid
+}
+
+MappedFile::~MappedFile() {
+    if (data_) munmap(const_cast<char*>(data_), size_);
+}
+#endif
+
+// Reads the fields of one line the way an istringstream of the line would with operator>>, without allocating: the
+// blanks are skipped, a failed read leaves 0 and makes all the following ones fail.
+class LineScanner {
+public:
+    LineScanner(const char *begin, const char *end) : p_(begin), end_(end), failed_(false) {}
+
+    LineScanner &operator>>(char &c) {
+        if (!skip_spaces()) return *this;
+        c = *p_++;
+        return *this;
+    }
+
+    LineScanner &operator>>(int &v) {
+        if (!skip_spaces()) return *this;
+        const char *q = p_;
+        const bool negative = *q == '-';
+        if (*q == '-' || *q == '+') ++q;
+        long long m = 0;
+        const char *digits = q;
+        for (; q < end_ && unsigned(*q - '0') < 10; ++q) m = std::min(m*10 + (*q - '0'), 1LL << 32);
+        if (q == digits) return fail(v);
+        if (negative) m = -m;
+        if (m < std::numeric_limits<int>::min() || m > std::numeric_limits<int>::max()) { // out of range, as for the floats
+            fail(v);
+            v = m < 0 ? std::numeric_limits<int>::min() : std::numeric_limits<int>::max();
+            return *this;
+        }
+        p_ = q;
+        v = int(m);
+        return *this;
+    }
+
+    // Clinger's fast path: a mantissa below 2^24 and a power of ten up to 1e10 are both exact floats, so a single
+    // multiplication or division rounds correctly; anything else goes through strtof, as the stream does
+    LineScanner &operator>>(float &v) {
+        if (!skip_spaces()) return *this;
+        static const float POW10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+        const char *q = p_;
+        const bool negative = *q == '-';
+        if (*q == '-' || *q == '+') ++q;
+        unsigned long long m = 0;
+        int digits = 0, exponent = 0;
+        for (; q < end_ && unsigned(*q - '0') < 10; ++q, ++digits) {
+            if (m < (1ULL << 60)) m = m*10 + unsigned(*q - '0'); else ++exponent;
+        }
+        if (q < end_ && *q == '.') {
+            for (++q; q < end_ && unsigned(*q - '0') < 10; ++q, ++digits) {
+                if (m < (1ULL << 60)) { m = m*10 + unsigned(*q - '0'); --exponent; }
+            }
+        }
+        if (!digits) return fail(v);
+        bool simple = true;
+        if (q < end_ && (*q == 'e' || *q == 'E')) {
+            const char *e = q + 1;
+            const bool eneg = e < end_ && *e == '-';
+            if (e < end_ && (*e == '-' || *e == '+')) ++e;
+            int x = 0;
+            const char *edigits = e;
+            for (; e < end_ && unsigned(*e - '0') < 10; ++e) x = std::min(x*10 + (*e - '0'), 100000);
+            simple = e != edigits; // an exponent without digits makes the stream fail, strtof tells
+            exponent += eneg ? -x : x;
+            q = e;
+        }
+        if (simple && m < (1ULL << 24) && exponent >= -10 && exponent <= 10) {
+            const float f = exponent < 0 ? float(m)/POW10[-exponent] : float(m)*POW10[exponent];
+            v = negative ? -f : f;
+            p_ = q;
+            return *this;
+        }
+        return slow(v, q);
+    }
+
+    explicit operator bool() const { return !failed_; }
+
+private:
+    bool skip_spaces() {
+        if (failed_) return false;
+        while (p_ < end_ && (*p_ == ' ' || unsigned(*p_ - '\t') <= '\r' - '\t')) ++p_;
+        if (p_ == end_) failed_ = true;
+        return !failed_;
+    }
+
+    template <typename T> LineScanner &fail(T &v) {
+        v = T(0);
+        failed_ = true;
+        return *this;
+    }
+
+    // the characters [p_, q) are the ones the stream would have gathered
+    LineScanner &slow(float &v, const char *q) {
+        char buffer[64];
+        std::string longer;
+        const size_t n = size_t(q - p_);
+        const char *text = buffer;
+        if (n < sizeof(buffer)) {
+            std::memcpy(buffer, p_, n);
+            buffer[n] = 0;
+        } else {
+            longer.assign(p_, q);
+            text = longer.c_str();
+        }
+        char *parsed;
+        const float f = std::strtof(text, &parsed);
+        if (parsed != text + n) return fail(v);
+        if (std::isinf(f)) { // out of range, the stream gives the largest float and fails
+            fail(v);
+            v = f > 0 ? std::numeric_limits<float>::max() : -std::numeric_limits<float>::max();
+            return *this;
+        }
+        v = f;
+        p_ = q;
+        return *this;
+    }
+
+    const char *p_;
+    const char *end_;
+    bool failed_;
+};
+
+inline bool starts_with(const char *begin, const char *end, const char *prefix) {
+    const size_t n = std::strlen(prefix);
+    return size_t(end - begin) >= n && !std::memcmp(begin, prefix, n);
+}
+
+// octahedral encoding: the unit sphere is projected onto the octahedron |x|+|y|+|z| = 1, the lower half is folded
+// over the diagonals, two bytes per normal instead of three
+void encode_octahedral(const unsigned char bgr[3], unsigned char out[2]) {
+    float n[3];
+    for (int i=0; i<3; i++) n[i] = bgr[2-i]/255.f*2.f - 1.f;
+    const float l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+    float p[2] = { 0.f, 0.f };
+    if (l1 > 0.f) {
+        p[0] = n[0]/l1;
+        p[1] = n[1]/l1;
+    }
+    if (n[2] < 0.f) {
+        const float q[2] = { p[0], p[1] };
+        p[0] = (1.f - std::abs(q[1]))*(q[0] >= 0.f ? 1.f : -1.f);
+        p[1] = (1.f - std::abs(q[0]))*(q[1] >= 0.f ? 1.f : -1.f);
+    }
+    for (int i=0; i<2; i++) out[i] = (unsigned char)std::lround((p[i]*.5f + .5f)*255.f);
+}
+
+// not normalized, the shader normalizes after the tangent basis anyway
+Vec3f decode_octahedral(float u, float v) {
+    Vec3f n(u, v, 1.f - std::abs(u) - std::abs(v));
+    const float t = std::max(-n.z, 0.f);
+    n.x += n.x >= 0.f ? -t : t;
+    n.y += n.y >= 0.f ? -t : t;
+    return n;
+}
+
+}
+
+Model::Model(const char *filename, ThreadPool *pool, bool compressTextures) : verts_(), faces_(), norms_(), uv_(), diffusemap_(), normalmap_(), specularmap_() {
+    MappedFile file(filename);
+    if (!file.is_open()) return;
+    std::vector<Vec3i> f; // the face being read, its storage reused from line to line
+    for (const char *line = file.begin(); line < file.end(); ) {
+        const char *eol = static_cast<const char*>(std::memchr(line, '\n', size_t(file.end() - line)));
+        if (!eol) eol = file.end();
+        LineScanner iss(line, eol);
         char trash;
-        if (!line.compare(0, 2, "v ")) {
+        if (starts_with(line, eol, "v ")) {
             iss >> trash;
             Vec3f v;
             for (int i=0;i<3;i++) iss >> v[i];
             verts_.push_back(v);
-        } else if (!line.compare(0, 3, "vn ")) {
+        } else if (starts_with(line, eol, "vn ")) {
             iss >> trash >> trash;
             Vec3f n;
             for (int i=0;i<3;i++) iss >> n[i];
             norms_.push_back(n);
-        } else if (!line.compare(0, 3, "vt ")) {
+        } else if (starts_with(line, eol, "vt ")) {
             iss >> trash >> trash;
             Vec2f uv;
             for (int i=0;i<2;i++) iss >> uv[i];
             uv_.push_back(uv);
-        }  else if (!line.compare(0, 2, "f ")) {
-            std::vector<Vec3i> f;
+        }  else if (starts_with(line, eol, "f ")) {
+            f.clear();
             Vec3i tmp;
             iss >> trash;
             while (iss >> tmp[0] >> trash >> tmp[1] >> trash >> tmp[2]) {
                 for (int i=0; i<3; i++) tmp[i]--; // in wavefront obj all indices start at 1, not zero
                 f.push_back(tmp);
             }
-            faces_.push_back(f);
+            faces_.push_back(f); // copied at its exact size
         }
+        if (eol == file.end()) break; // no newline at the end of the file
+        line = eol + 1;
     }
     std::cerr << "# v# " << verts_.size() << " f# "  << faces_.size() << " vt# " << uv_.size() << " vn# " << norms_.size() << std::endl;
-    load_texture(filename, "_diffuse.tga", diffusemap_);
-    load_texture(filename, "_nm_tangent.tga",      normalmap_);
-    load_texture(filename, "_spec.tga",    specularmap_);
+    load_texture(filename, "_diffuse.tga", diffusemap_, pool, compressTextures ? Texture::BC1 : Texture::RAW);
+    load_normal_map(filename, "_nm_tangent.tga", normalmap_, pool, compressTextures ? Texture::BC5 : Texture::RAW);
+    load_texture(filename, "_spec.tga",    specularmap_, pool, Texture::RAW);
 }
 
 Model::~Model() {}
@@ -68,28 +305,57 @@ Vec3f Model::vert(int iface, int nthvert) {
     return verts_[faces_[iface][nthvert][0]];
 }
 
-void Model::load_texture(std::string filename, const char *suffix, TGAImage &img) {
+int Model::vert_index(int iface, int nthvert) {
+    return faces_[iface][nthvert][0];
+}
+
+const Vec3fStream &Model::verts() const {
+    return verts_;
+}
+
+bool Model::read_texture(std::string filename, const char *suffix, TGAImage &img) {
     std::string texfile(filename);
     size_t dot = texfile.find_last_of(".");
-    if (dot!=std::string::npos) {
-        texfile = texfile.substr(0,dot) + std::string(suffix);
-        std::cerr << "texture file " << texfile << " loading " << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
-        img.flip_vertically();
-    }
+    if (dot==std::string::npos) return false;
+    texfile = texfile.substr(0,dot) + std::string(suffix);
+    bool ok = img.read_tga_file(texfile.c_str());
+    std::cerr << "texture file " << texfile << " loading " << (ok ? "ok" : "failed") << std::endl;
+    img.flip_vertically();
+    return ok;
+}
+
+void Model::load_texture(std::string filename, const char *suffix, Texture &tex, ThreadPool *pool, Texture::Format format) {
+    TGAImage img;
+    if (read_texture(filename, suffix, img)) tex.init(img, pool, format);
+}
+
+void Model::load_normal_map(std::string filename, const char *suffix, Texture &tex, ThreadPool *pool, Texture::Format format) {
+    TGAImage img;
+    if (!read_texture(filename, suffix, img) || img.get_bytespp() < 3) return;
+    const int w = img.get_width(), h = img.get_height(), bpp = img.get_bytespp();
+    std::vector<unsigned char> packed(w*h*2);
+    const unsigned char *src = img.buffer();
+    for (int i=0; i<w*h; i++)
+        encode_octahedral(src + i*bpp, &packed[i*2]);
+    tex.init(w, h, 2, packed.data(), pool, format);
 }
 
 TGAColor Model::diffuse(Vec2f uvf) {
-    Vec2i uv(uvf[0]*diffusemap_.get_width(), uvf[1]*diffusemap_.get_height());
-    return diffusemap_.get(uv[0], uv[1]);
+    return diffusemap_.nearest(uvf);
+}
+
+TGAColor Model::diffuse(Vec2f uvf, Vec2f duvdx, Vec2f duvdy) {
+    Vec4f c = diffusemap_.sample(uvf, diffusemap_.lod(duvdx, duvdy));
+    unsigned char bgra[4];
+    for (int i=0; i<4; i++)
+        bgra[i] = (unsigned char)(c[i] + .5f);
+    return TGAColor(bgra, diffusemap_.get_bytespp());
 }
 
 Vec3f Model::normal(Vec2f uvf) {
-    Vec2i uv(uvf[0]*normalmap_.get_width(), uvf[1]*normalmap_.get_height());
-    TGAColor c = normalmap_.get(uv[0], uv[1]);
-    Vec3f res;
-    for (int i=0; i<3; i++)
-        res[2-i] = (float)c[i]/255.f*2.f - 1.f;
-    return res;
+    if (!normalmap_.get_width()) return Vec3f(-1.f, -1.f, -1.f); // the black texel of a missing map, as before the packing
+    TGAColor c = normalmap_.nearest(uvf);
+    return decode_octahedral(c[0]/255.f*2.f - 1.f, c[1]/255.f*2.f - 1.f).normalize();
 }
 
 Vec2f Model::uv(int iface, int nthvert) {
@@ -97,8 +363,22 @@ Vec2f Model::uv(int iface, int nthvert) {
 }
 
 float Model::specular(Vec2f uvf) {
-    Vec2i uv(uvf[0]*specularmap_.get_width(), uvf[1]*specularmap_.get_height());
-    return specularmap_.get(uv[0], uv[1])[0]/1.f;
+    return specularmap_.nearest(uvf)[0]/1.f;
+}
+
+float Model::specular(Vec2f uvf, Vec2f duvdx, Vec2f duvdy) {
+    return specularmap_.sample(uvf, specularmap_.lod(duvdx, duvdy))[0];
+}
+
+Vec3f Model::normal(Vec2f uvf, Vec2f duvdx, Vec2f duvdy) {
+    Vec2f p = packed_normal(uvf, duvdx, duvdy);
+    return decode_octahedral(p[0]/255.f*2.f - 1.f, p[1]/255.f*2.f - 1.f).normalize();
+}
+
+Vec2f Model::packed_normal(Vec2f uvf, Vec2f duvdx, Vec2f duvdy) {
+    if (!normalmap_.get_width()) return Vec2f(255.f/6.f, 255.f/6.f); // (-1, -1, -1) encoded, as normal() gives
+    Vec4f c = normalmap_.sample(uvf, normalmap_.lod(duvdx, duvdy));
+    return Vec2f(c[0], c[1]);
 }
 
 Vec3f Model::normal(int iface, int nthvert) {
@@ -106,3 +386,6 @@ Vec3f Model::normal(int iface, int nthvert) {
     return norms_[idx].normalize();
 }
 
+size_t Model::texture_memory() const {
+    return diffusemap_.get_memory() + normalmap_.get_memory() + specularmap_.get_memory();
+}
@@ -4,30 +4,44 @@
 #include <string>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "texture.h"
+
+class ThreadPool;
 
 class Model {
 private:
-    std::vector<Vec3f> verts_;
+    Vec3fStream verts_;
     std::vector<std::vector<Vec3i> > faces_; // attention, this Vec3i means vertex/uv/normal
     std::vector<Vec3f> norms_;
     std::vector<Vec2f> uv_;
-    TGAImage diffusemap_;
-    TGAImage normalmap_;
-    TGAImage specularmap_;
-    void load_texture(std::string filename, const char *suffix, TGAImage &img);
+    Texture diffusemap_;
+    Texture normalmap_;
+    Texture specularmap_;
+    static bool read_texture(std::string filename, const char *suffix, TGAImage &img);
+    void load_texture(std::string filename, const char *suffix, Texture &tex, ThreadPool *pool, Texture::Format format);
+    void load_normal_map(std::string filename, const char *suffix, Texture &tex, ThreadPool *pool, Texture::Format format);
 public:
-    Model(const char *filename);
+    // the mip chains are built on the pool if any; compressTextures keeps the diffuse map as BC1 and the normal map as BC5
+    // the normal map is stored octahedral-encoded in two channels, see packed_normal()
+    Model(const char *filename, ThreadPool *pool = nullptr, bool compressTextures = false);
     ~Model();
     int nverts();
     int nfaces();
     Vec3f normal(int iface, int nthvert);
     Vec3f normal(Vec2f uv);
+    Vec3f normal(Vec2f uv, Vec2f duvdx, Vec2f duvdy); // duvdx, duvdy: screen-space derivatives of uv, trilinear
+    Vec2f packed_normal(Vec2f uv, Vec2f duvdx, Vec2f duvdy); // the filtered octahedral coordinates, 0..255, not decoded
     Vec3f vert(int i);
     Vec3f vert(int iface, int nthvert);
+    int vert_index(int iface, int nthvert);
+    const Vec3fStream &verts() const; // all the positions, for the batch transforms
     Vec2f uv(int iface, int nthvert);
     TGAColor diffuse(Vec2f uv);
+    TGAColor diffuse(Vec2f uv, Vec2f duvdx, Vec2f duvdy);
     float specular(Vec2f uv);
+    float specular(Vec2f uv, Vec2f duvdx, Vec2f duvdy);
     std::vector<int> face(int idx);
+    size_t texture_memory() const;
 };
 #endif //__MODEL_H__
 
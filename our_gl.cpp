@@ -2,87 +2,295 @@
 #include <limits>
 #include <cstdlib>
 #include "our_gl.h"
+#include "rasterizer.h"
 #include <algorithm>
 
-Matrix ModelView;
-Matrix Viewport;
-Matrix Projection;
+Affine3 ModelView;
+ViewportTransform Viewport;
+Perspective Projection;
+RasterStats raster_stats;
+PrimitiveStats primitive_stats;
 
 IShader::~IShader() {}
 
+int IShader::fragments(int mask, const float bar[3][FRAGMENT_BATCH], unsigned colors[FRAGMENT_BATCH]) {
+    TGAColor color;
+    for (int l=0; l<FRAGMENT_BATCH; l++) {
+        if (!(mask>>l & 1)) continue;
+        if (fragment(Vec3f(bar[0][l], bar[1][l], bar[2][l]), color)) {
+            mask &= ~(1<<l);
+        } else {
+            colors[l] = pack_color(color);
+        }
+    }
+    return mask;
+}
+
 void viewport(int x, int y, int w, int h) {
-    Viewport = Matrix::identity();
-    Viewport[0][3] = x+w/2.f;
-    Viewport[1][3] = y+h/2.f;
-    Viewport[2][3] = 1.f;
-    Viewport[0][0] = w/2.f;
-    Viewport[1][1] = h/2.f;
-    Viewport[2][2] = 0;
+    Viewport.offset = Vec2f(x+w/2.f, y+h/2.f);
+    Viewport.scale = Vec2f(w/2.f, h/2.f);
 }
 
 void projection(float coeff) {
-    Projection = Matrix::identity();
-    Projection[3][2] = coeff;
+    Projection = Perspective(coeff);
 }
 
 void lookat(Vec3f eye, Vec3f center, Vec3f up) {
     Vec3f z = (eye-center).normalize();
     Vec3f x = cross(up,z).normalize();
     Vec3f y = cross(z,x).normalize();
-    Matrix Minv = Matrix::identity();
-    Matrix Tr   = Matrix::identity();
+    mat<3,3,float> Minv;
+    Minv[0] = x;
+    Minv[1] = y;
+    Minv[2] = z;
+    ModelView = Affine3(Minv, Vec3f(0, 0, 0)) * Affine3(mat<3,3,float>::identity(), Vec3f(0, 0, 0)-center);
+}
+
+void Uniforms::init(Vec3f light) {
+    mvp = Projection*ModelView;
+    // the inverse of Projection*ModelView is ModelView^-1*Projection^-1, Projection^-1 differing from the identity
+    // only by -coeff*z added to w: the upper left part of the product is the 3x3 part of ModelView^-1 plus its
+    // translation times -coeff in the third column, without any 4x4 inversion
+    const Affine3 inv = ModelView.inverse();
+    mvp_it = inv.linear.transpose();
+    for (int j=0; j<3; j++) mvp_it[2][j] -= Projection.coeff*inv.translation[j];
+    light_dir = mvp.vector(light).normalize();
+}
+
+namespace {
+
+using raster::SUBPIXEL_BITS;
+using raster::SUBPIXEL_ONE;
+const float MAX_SCREEN_COORD = 8192.f;       // keeps the 64-bit edge functions far from overflowing
+const float GUARD_BAND = 4096.f;             // triangles going farther than that from the screen origin get clipped
+const float NEAR_W = 1e-4f;                  // as well as the ones crossing the plane of the eye
+
+inline int snap(float v) {
+    return int(std::floor(v*SUBPIXEL_ONE + .5f));
+}
+
+// vertex of a triangle being clipped, along with its barycentric coordinates in the original triangle
+struct ClipVertex {
+    Vec4f pos;
+    Vec3f bar;
+};
+
+const int CLIP_PLANES = 5;
+const int MAX_CLIP_VERTICES = 3 + CLIP_PLANES; // = MAX_PRIMITIVES + 2
+
+// Triangles are rasterized directly as long as they stay in front of the eye and within the guard band, a region much
+// larger than the screen; only the few ones going outside are clipped. The planes are expressed in clip coordinates.
+struct GuardBand {
+    GuardBand() {
+        for (int j=0; j<2; j++) {
+            lo[j] = (-GUARD_BAND - Viewport.offset[j])/Viewport.scale[j];
+            hi[j] = ( GUARD_BAND - Viewport.offset[j])/Viewport.scale[j];
+        }
+    }
+
+    float distance(int plane, const Vec4f &v) const { // positive inside
+        switch (plane) {
+        case 0:  return v[3] - NEAR_W;
+        case 1:  return v[0] - lo[0]*v[3];
+        case 2:  return hi[0]*v[3] - v[0];
+        case 3:  return v[1] - lo[1]*v[3];
+        default: return hi[1]*v[3] - v[1];
+        }
+    }
+
+    bool contains(const mat<4,3,float> &clipc) const {
+        for (int i=0; i<3; i++)
+            for (int p=0; p<CLIP_PLANES; p++)
+                if (distance(p, clipc.col(i))<0) return false;
+        return true;
+    }
+
+    // Sutherland-Hodgman clipping of the convex polygon poly of n vertices, returns the new number of vertices
+    int clip(ClipVertex *poly, int n) const {
+        ClipVertex tmp[MAX_CLIP_VERTICES];
+        for (int p=0; p<CLIP_PLANES && n; p++) {
+            int m = 0;
+            for (int i=0; i<n; i++) {
+                const ClipVertex &a = poly[i], &b = poly[(i+1)%n];
+                const float da = distance(p, a.pos), db = distance(p, b.pos);
+                if (da>=0) tmp[m++] = a;
+                if ((da>=0) != (db>=0)) {
+                    const float t = da/(da-db);
+                    tmp[m].pos = a.pos + (b.pos-a.pos)*t;
+                    tmp[m].bar = a.bar + (b.bar-a.bar)*t;
+                    m++;
+                }
+            }
+            std::copy(tmp, tmp+m, poly);
+            n = m;
+        }
+        return n;
+    }
+
+    float lo[2], hi[2];
+};
+
+
+}
+
+RasterStats::Counters::Counters()
+    : tested(0), block_rejected(0), coarse_rejected(0), coverage_rejected(0), depth_rejected(0), shaded(0), discarded(0) {
+}
+
+RasterStats::RasterStats()
+    : tested(0), block_rejected(0), coarse_rejected(0), coverage_rejected(0), depth_rejected(0), shaded(0), discarded(0) {
+}
+
+void RasterStats::add(const Counters &c) {
+    tested            += c.tested;
+    block_rejected    += c.block_rejected;
+    coarse_rejected   += c.coarse_rejected;
+    coverage_rejected += c.coverage_rejected;
+    depth_rejected    += c.depth_rejected;
+    shaded            += c.shaded;
+    discarded         += c.discarded;
+}
+
+std::ostream& operator<<(std::ostream& out, const RasterStats &stats) {
+    out << "pixels tested " << stats.tested << ", rejected by block coverage " << stats.block_rejected
+        << ", by coarse depth " << stats.coarse_rejected << ", by coverage " << stats.coverage_rejected
+        << ", by depth " << stats.depth_rejected << "; shaded " << stats.shaded << ", discarded " << stats.discarded;
+    return out;
+}
+
+PrimitiveStats::PrimitiveStats() : submitted(0), backfacing(0), outside(0) {
+}
+
+void PrimitiveStats::add(long long submitted_, long long backfacing_, long long outside_) {
+    submitted  += submitted_;
+    backfacing += backfacing_;
+    outside    += outside_;
+}
+
+std::ostream& operator<<(std::ostream& out, const PrimitiveStats &stats) {
+    out << "triangles submitted " << stats.submitted << ", culled as back-facing " << stats.backfacing
+        << ", as outside of the clip volume " << stats.outside;
+    return out;
+}
+
+Culling cull(const mat<4,3,float> &clipc, Vec2i screen) {
+    // the viewport may map [-1,1] to a part of the screen only, so the visible volume is lo*w<=x<=hi*w, lo*w<=y<=hi*w, w>0
+    // with lo and hi the edges of the screen in NDC: a triangle with all its vertices outside of the same plane is invisible
+    float lo[2], hi[2];
+    for (int j=0; j<2; j++) {
+        lo[j] = (0.f       - Viewport.offset[j])/Viewport.scale[j];
+        hi[j] = (screen[j] - Viewport.offset[j])/Viewport.scale[j];
+    }
+    int outcode = 31;
     for (int i=0; i<3; i++) {
-        Minv[0][i] = x[i];
-        Minv[1][i] = y[i];
-        Minv[2][i] = z[i];
-        Tr[i][3] = -center[i];
+        const float x = clipc[0][i], y = clipc[1][i], w = clipc[3][i];
+        outcode &= (x<lo[0]*w) | (x>hi[0]*w)<<1 | (y<lo[1]*w)<<2 | (y>hi[1]*w)<<3 | (w<=0)<<4;
     }
-    ModelView = Minv*Tr;
+    if (outcode) return CULL_OUTSIDE;
+
+    // front faces are counter-clockwise on the screen, the orientation is meaningful only with all the vertices in front of the eye
+    if (clipc[3][0]<=0 || clipc[3][1]<=0 || clipc[3][2]<=0) return CULL_NONE;
+    Vec2f ndc[3];
+    for (int i=0; i<3; i++) ndc[i] = Vec2f(clipc[0][i]/clipc[3][i], clipc[1][i]/clipc[3][i]);
+    const float area = (ndc[1].x-ndc[0].x)*(ndc[2].y-ndc[0].y) - (ndc[1].y-ndc[0].y)*(ndc[2].x-ndc[0].x);
+    return area<0 ? CULL_BACKFACE : CULL_NONE;
 }
 
-Vec3f barycentric(Vec2f A, Vec2f B, Vec2f C, Vec2f P) {
-    Vec3f s[2];
-    for (int i=2; i--; ) {
-        s[i][0] = C[i]-A[i];
-        s[i][1] = B[i]-A[i];
-        s[i][2] = A[i]-P[i];
+bool TriangleSetup::init(const mat<4,3,float> &clipc) {
+    int X[3], Y[3]; // fixed point screen coordinates
+    for (int i=0; i<3; i++) {
+        const Vec4f v4 = clipc.col(i);
+        Vec2f v = Viewport.screen(v4);
+        if (!(std::abs(v.x)<MAX_SCREEN_COORD && std::abs(v.y)<MAX_SCREEN_COORD)) return false; // also catches NaNs
+        X[i] = snap(v.x);
+        Y[i] = snap(v.y);
+        inv_w[i] = 1.f/v4[3];
+        zw[i] = v4[2]*inv_w[i];
     }
-    Vec3f u = cross(s[0], s[1]);
-    if (std::abs(u[2])>1e-2) // dont forget that u[2] is integer. If it is zero then triangle ABC is degenerate
-        return Vec3f(1.f-(u.x+u.y)/u.z, u.y/u.z, u.x/u.z);
-    return Vec3f(-1,1,1); // in this case generate negative coordinates, it will be thrown away by the rasterizator
+
+    area = (long long)(X[1]-X[0])*(Y[2]-Y[0]) - (long long)(Y[1]-Y[0])*(X[2]-X[0]);
+    if (!area) return false; // degenerate triangle, nothing to draw
+    const int orient = area>0 ? 1 : -1;
+    area *= orient;
+
+    // edge equations: E[i] = A[i]*x + B[i]*y + C[i] is twice the signed area of the triangle formed by P and the edge
+    // opposite to vertex i, so E[i]/area is the barycentric coordinate of P. The orientation is normalized to make the
+    // inside positive. The top-left fill rule: pixels lying exactly on an edge belong to the triangle only if the edge
+    // is a top or a left one, that way pixels on an edge shared by two triangles are shaded exactly once.
+    for (int i=0; i<3; i++) {
+        const int j = (i+1)%3, k = (i+2)%3;
+        A[i] = (long long)orient*(Y[j]-Y[k]);
+        B[i] = (long long)orient*(X[k]-X[j]);
+        C[i] = (long long)orient*((long long)X[j]*Y[k] - (long long)Y[j]*X[k]);
+        const bool topleft = A[i]>0 || (A[i]==0 && B[i]<0);
+        if (!topleft) C[i] -= 1; // E >= 1 becomes E-1 >= 0
+    }
+
+    xmin = (std::min(X[0], std::min(X[1], X[2])) + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS;
+    ymin = (std::min(Y[0], std::min(Y[1], Y[2])) + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS;
+    xmax =  std::max(X[0], std::max(X[1], X[2])) >> SUBPIXEL_BITS;
+    ymax =  std::max(Y[0], std::max(Y[1], Y[2])) >> SUBPIXEL_BITS;
+    return xmin<=xmax && ymin<=ymax;
 }
 
-void triangle(mat<4,3,float> &clipc, IShader &shader, FrameTile &image) {
-    mat<3,4,float> pts  = (Viewport*clipc).transpose(); // transposed to ease access to each of the points
-    mat<3,2,float> pts2;
-    for (int i=0; i<3; i++) pts2[i] = proj<2>(pts[i]/pts[i][3]);
-
-    Vec2f bboxmin( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
-    Vec2f bboxmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
-    Vec2f clampTopLeft(image.get_left(), image.get_top());
-    Vec2f clampBottomRight(image.get_right() - 1, image.get_bottom() - 1);
+bool PixelBarycentrics::init(const mat<4,3,float> &clipc) {
+    // the clip coordinates b[0]*v0+b[1]*v1+b[2]*v2 of the point seen through the pixel must be proportional to
+    // (ndc.x, ndc.y, *, 1), that gives b up to a scale factor as the inverse of the (x, y, w) rows applied to the ndc
+    mat<3,3,float> M;
+    M[0] = clipc[0];
+    M[1] = clipc[1];
+    M[2] = clipc[3];
+    if (std::abs(M.det())<1e-12f) return false; // the plane of the triangle contains the eye
+    mat<3,3,float> screen_to_ndc = mat<3,3,float>::identity();
+    for (int j=0; j<2; j++) {
+        screen_to_ndc[j][j] = 1.f/Viewport.scale[j];
+        screen_to_ndc[j][2] = -Viewport.offset[j]/Viewport.scale[j];
+    }
+    K = M.invert()*screen_to_ndc;
+    return true;
+}
+
+Vec3f PixelBarycentrics::at(int x, int y) const {
+    Vec3f bc_clip = K*Vec3f(x, y, 1);
+    return bc_clip/(bc_clip.x+bc_clip.y+bc_clip.z);
+}
+
+int assemble(const mat<4,3,float> &clipc, Primitive *prims) {
+    const GuardBand guard;
+    if (guard.contains(clipc)) {
+        prims[0].clipped = false;
+        return prims[0].setup.init(clipc) ? 1 : 0;
+    }
+    ClipVertex poly[MAX_CLIP_VERTICES];
     for (int i=0; i<3; i++) {
-        for (int j=0; j<2; j++) {
-            bboxmin[j] = std::max(clampTopLeft[j], std::min(bboxmin[j], pts2[i][j]));
-            bboxmax[j] = std::min(clampBottomRight[j], std::max(bboxmax[j], pts2[i][j]));
-        }
+        poly[i].pos = clipc.col(i);
+        poly[i].bar = Vec3f(i==0, i==1, i==2);
     }
-    Vec2i P;
-    TGAColor color;
-    for (P.x=bboxmin.x; P.x<=bboxmax.x; P.x++) {
-        for (P.y=bboxmin.y; P.y<=bboxmax.y; P.y++) {
-            Vec3f bc_screen  = barycentric(pts2[0], pts2[1], pts2[2], P);
-            Vec3f bc_clip    = Vec3f(bc_screen.x/pts[0][3], bc_screen.y/pts[1][3], bc_screen.z/pts[2][3]);
-            bc_clip = bc_clip/(bc_clip.x+bc_clip.y+bc_clip.z);
-            float frag_depth = clipc[2]*bc_clip;
-            if (bc_screen.x<0 || bc_screen.y<0 || bc_screen.z<0 || image.get_z(P.x, P.y)>frag_depth) continue;
-            bool discard = shader.fragment(bc_clip, color);
-            if (!discard) {
-                image.set_z(P.x, P.y, frag_depth);
-                image.set(P.x, P.y, color);
-            }
+    const int n = guard.clip(poly, 3);
+    int count = 0;
+    for (int i=2; i<n; i++) { // the clipped polygon is convex, it is split in a fan
+        Primitive &prim = prims[count];
+        mat<4,3,float> piece;
+        const ClipVertex *v[3] = { &poly[0], &poly[i-1], &poly[i] };
+        for (int k=0; k<3; k++) {
+            piece.set_col(k, v[k]->pos);
+            prim.barmap.set_col(k, v[k]->bar);
         }
+        prim.clipped = true;
+        if (prim.setup.init(piece)) count++;
     }
+    return count;
+}
+
+void rasterize(const Primitive &prim, IShader &shader, FrameTile &image) {
+    rasterize<IShader>(prim, shader, image);
 }
 
+void rasterize(const Primitive &prim, unsigned id, FrameTile &image) {
+    raster::IdOutput output(id, image);
+    raster::rasterize(prim.setup, output, image);
+}
+
+void triangle(mat<4,3,float> &clipc, IShader &shader, FrameTile &image) {
+    triangle<IShader>(clipc, shader, image);
+}
@@ -1,20 +1,150 @@
 #pragma once
 
+#include <atomic>
+#include <ostream>
 #include "frametile.h"
 #include "geometry.h"
+#include "transform.h"
 
-extern Matrix ModelView;
-extern Matrix Projection;
+extern Affine3 ModelView;
+extern Perspective Projection;
+extern ViewportTransform Viewport;
+
+// how many pixels each stage of the rasterizer rejects, accumulated over all the triangles drawn
+struct RasterStats {
+    struct Counters {
+        Counters();
+        long long tested;            // pixels of the blocks of the triangles bounding boxes
+        long long block_rejected;    // in blocks lying outside of the triangle
+        long long coarse_rejected;   // in blocks hidden according to the coarse depth buffer
+        long long coverage_rejected; // outside of the triangle
+        long long depth_rejected;    // failing the depth test
+        long long shaded;            // fragments handed over to the shader or to the visibility buffer
+        long long discarded;         // fragments discarded by the shader
+    };
+
+    RasterStats();
+    void add(const Counters &c);
+
+    std::atomic<long long> tested;
+    std::atomic<long long> block_rejected;
+    std::atomic<long long> coarse_rejected;
+    std::atomic<long long> coverage_rejected;
+    std::atomic<long long> depth_rejected;
+    std::atomic<long long> shaded;
+    std::atomic<long long> discarded;
+};
+
+std::ostream& operator<<(std::ostream& out, const RasterStats &stats);
+
+extern RasterStats raster_stats;
+
+// how many triangles the primitive assembly stage drops
+struct PrimitiveStats {
+    PrimitiveStats();
+    void add(long long submitted_, long long backfacing_, long long outside_);
+
+    std::atomic<long long> submitted;
+    std::atomic<long long> backfacing;
+    std::atomic<long long> outside;  // lying entirely outside of the clip volume
+};
+
+std::ostream& operator<<(std::ostream& out, const PrimitiveStats &stats);
+
+extern PrimitiveStats primitive_stats;
 
 void viewport(int x, int y, int w, int h);
 void projection(float coeff=0.f); // coeff = -1/c
 void lookat(Vec3f eye, Vec3f center, Vec3f up);
 
+// constants shared by all the vertices and fragments of a draw, computed once from ModelView and Projection
+struct Uniforms {
+    void init(Vec3f light);
+
+    PerspectiveAffine mvp;  // Projection*ModelView
+    mat<3,3,float> mvp_it;  // upper left part of its inverse transpose, the part that transforms the normals
+    Vec3f light_dir;        // transformed by mvp and normalized
+};
+
+const int FRAGMENT_BATCH = 8; // fragments handed over at once to IShader::fragments
+
+// The fragments of a batch are laid out as 2x2 quads, lane l lies at (lane_x(l), lane_y(l)) from the top left pixel of
+// the batch: the lanes l, l^1 are horizontal neighbours and the lanes l, l^2 vertical ones.
+inline int lane_x(int l) { return (l>>2)*2 + (l&1); }
+inline int lane_y(int l) { return l>>1 & 1; }
+
 struct IShader {
     virtual ~IShader();
     virtual Vec4f vertex(int iface, int nthvert) = 0;
+    virtual void setup() {} // once per triangle, after its three vertices and before any of its fragments
     virtual bool fragment(Vec3f bar, TGAColor &color) = 0;
+    // Shades the fragments whose bit is set in mask, bar holds their barycentric coordinates as structure of arrays.
+    // The other lanes of the quads are helpers: their coordinates are valid, extrapolated outside of the triangle,
+    // so that screen-space derivatives can be taken across each quad. Writes the colors packed as 0xAARRGGBB and
+    // returns the mask of the fragments not discarded. The default implementation calls fragment() for each of them.
+    virtual int fragments(int mask, const float bar[3][FRAGMENT_BATCH], unsigned colors[FRAGMENT_BATCH]);
 };
 
+inline unsigned pack_color(const TGAColor &c) {
+    return unsigned(c.bgra[3])<<24 | unsigned(c.bgra[2])<<16 | unsigned(c.bgra[1])<<8 | c.bgra[0];
+}
+
+inline TGAColor unpack_color(unsigned c) {
+    return TGAColor(c>>16 & 0xFF, c>>8 & 0xFF, c & 0xFF, c>>24);
+}
+
+// screen-space setup of a triangle for the rasterizer: vertices snapped to fixed point and edge functions
+struct TriangleSetup {
+    bool init(const mat<4,3,float> &clipc); // false if the triangle can not cover any pixel
+
+    long long A[3], B[3], C[3];  // edge functions of the fixed point coordinates, positive inside
+    long long area;              // twice the area, in squared fixed point units
+    int xmin, ymin, xmax, ymax;  // bounding box in pixels
+    float inv_w[3];              // 1/w of the vertices
+    float zw[3];                 // z/w of the vertices, it is what the depth buffer holds
+};
+
+// primitive assembly: tells whether a triangle can be dropped before it gets set up
+enum Culling {
+    CULL_NONE,
+    CULL_BACKFACE,
+    CULL_OUTSIDE
+};
+
+Culling cull(const mat<4,3,float> &clipc, Vec2i screen); // screen is the size of the frame in pixels
+
+// perspective correct barycentric coordinates of the pixels with respect to a triangle given in clip coordinates,
+// computed without perspective division so that they stay valid for the triangles that had to be clipped
+struct PixelBarycentrics {
+    bool init(const mat<4,3,float> &clipc); // false if the triangle is seen edge-on
+    Vec3f at(int x, int y) const;
+
+    mat<3,3,float> K;
+};
+
+// a triangle ready to be rasterized; the pieces of a clipped triangle map their barycentric coordinates
+// to the ones of the original triangle
+struct Primitive {
+    TriangleSetup setup;
+    mat<3,3,float> barmap;
+    bool clipped;
+};
+
+const int MAX_PRIMITIVES = 6;
+
+// clips the triangle if it crosses the plane of the eye or goes outside of the guard band and sets up the resulting
+// pieces, writes at most MAX_PRIMITIVES primitives and returns their count
+int assemble(const mat<4,3,float> &clipc, Primitive *prims);
+
+void rasterize(const Primitive &prim, IShader &shader, FrameTile &image);
+void rasterize(const Primitive &prim, unsigned id, FrameTile &image); // writes the depth and the id to the visibility buffer
+
+// assembles and rasterizes a triangle at once
 void triangle(mat<4,3,float> &pts, IShader &shader, FrameTile &image);
 
+// Same as above with the shader stages called without virtual dispatch, so that they can be inlined in the
+// rasterizer loops. Defined in rasterizer.h; rasterize<ShaderT> is explicitly instantiated next to each concrete
+// shader, whose binned primitives go through it. The IShader overloads remain for shaders picked at runtime.
+template <class ShaderT> void rasterize(const Primitive &prim, ShaderT &shader, FrameTile &image);
+template <class ShaderT> void triangle(mat<4,3,float> &pts, ShaderT &shader, FrameTile &image);
+
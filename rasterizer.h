@@ -0,0 +1,231 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "our_gl.h"
+#include "simd.h"
+
+// The rasterizer templates, included by our_gl.cpp and by the translation units that instantiate
+// rasterize<ShaderT> for their concrete shaders.
+
+namespace raster {
+
+static_assert(SIMD_WIDTH <= FRAGMENT_BATCH, "a span of pixels must fit in a batch of fragments");
+
+const int SUBPIXEL_BITS = 4;                 // vertices are snapped to 1/16th of a pixel
+const int SUBPIXEL_ONE  = 1 << SUBPIXEL_BITS;
+const int BLOCK_SIZE = DepthBuffer::BLOCK_SIZE; // triangles are walked in the blocks of the coarse depth buffer
+
+// A lane at offset lane_e from an edge function value e is inside iff lane_e >= -e. The lane offsets are tiny
+// compared to 2^30, so clamping the threshold to 32 bits gives an exact test whatever the magnitude of e.
+inline int edge_threshold(long long e) {
+    const long long limit = 1<<30;
+    return int(std::max(-limit, std::min(limit, -e)));
+}
+
+const int QUAD_SPAN = SIMD_WIDTH/2; // a span is a row of SIMD_WIDTH/4 quads, QUAD_SPAN pixels wide and 2 high
+
+// writes the fragments through the fragment shader; the calls are resolved at compile time unless ShaderT is IShader
+template <class ShaderT> struct ShaderOutput {
+    static const bool needs_barycentrics = true;
+
+    ShaderOutput(ShaderT &s, FrameTile &img) : shader(s), image(img), barmap(nullptr) {}
+
+    int shade(int x, int y, int visible, const float bar[3][FRAGMENT_BATCH]) {
+        float mapped[3][FRAGMENT_BATCH];
+        if (barmap) {
+            for (int i=0; i<3; i++) {
+                vfloat b = vfloat(0.f);
+                for (int j=0; j<3; j++) b = b + vfloat((*barmap)[i][j])*vfloat::load(bar[j]);
+                b.store(mapped[i]);
+            }
+            bar = mapped;
+        }
+        const int written = shader.fragments(visible, bar, colors);
+        for (int l=0; l<SIMD_WIDTH; l++) {
+            if (written>>l & 1) image.set(x+lane_x(l), y+lane_y(l), unpack_color(colors[l]));
+        }
+        return written;
+    }
+
+    ShaderT &shader;
+    FrameTile &image;
+    unsigned colors[FRAGMENT_BATCH];
+    const mat<3,3,float> *barmap; // maps the barycentrics of a clipped piece to the ones of the original triangle
+};
+
+// writes the id of the triangle to the visibility buffer
+struct IdOutput {
+    static const bool needs_barycentrics = false;
+
+    IdOutput(unsigned i, FrameTile &img) : id(i), image(img), barmap(nullptr) {}
+
+    int shade(int x, int y, int visible, const float (*)[FRAGMENT_BATCH]) {
+        for (int l=0; l<SIMD_WIDTH; l++) {
+            if (visible>>l & 1) *image.get_id_ptr(x+lane_x(l), y+lane_y(l)) = id;
+        }
+        return visible;
+    }
+
+    unsigned id;
+    FrameTile &image;
+    const mat<3,3,float> *barmap; // unused, the visibility buffer refers to the original triangle
+};
+
+// per-triangle state shared by all the spans of pixels of the triangle
+template <class Output> struct SpanRasterizer {
+    SpanRasterizer(Output &o, FrameTile &img) : output(o), image(img), bar() {}
+
+    // shades the span of quads whose top left pixel is (x,y), e are the edge functions at (x,y); only the pixels within
+    // the block [x0,x1]x[y0,y1] are considered. Returns the mask of the written pixels. The coverage test is skipped for
+    // blocks known to lie entirely inside the triangle. The screen-space depth is tested first, the perspective
+    // correction is paid only by the quads having a pixel that passes it. Lanes outside of the triangle still get their
+    // barycentric coordinates, extrapolated, so that the shader can difference them across the quads.
+    int span(int x, int y, int x0, int y0, int x1, int y1, const long long e[3], bool inside) {
+        const vint px = vint(x) + lane_dx, py = vint(y) + lane_dy;
+        vmask mask = (px >= vint(x0)) & (vint(x1) >= px) & (py >= vint(y0)) & (vint(y1) >= py);
+        const int valid = mask.bits();
+        if (!inside) {
+            for (int i=0; i<3; i++) mask = mask & (lane_e[i] >= vint(edge_threshold(e[i])));
+            const int covered = mask.bits();
+            stats.coverage_rejected += lane_count(valid) - lane_count(covered);
+            if (!covered) return 0;
+        }
+        const float e0[3] = { float(e[0]), float(e[1]), float(e[2]) };
+        const vfloat frag_depth = vfloat(e0[0]*zw[0] + e0[1]*zw[1] + e0[2]*zw[2]) + lane_dz;
+        float *zptr[SIMD_WIDTH] = {};
+        float zs[SIMD_WIDTH] = {};
+        for (int l=0; l<SIMD_WIDTH; l++) {
+            if (!(valid>>l & 1)) continue;
+            zptr[l] = image.get_z_ptr(x+lane_x(l), y+lane_y(l));
+            zs[l] = *zptr[l];
+        }
+        const int visible = (mask & (frag_depth >= vfloat::load(zs))).bits();
+        stats.depth_rejected += lane_count(mask.bits()) - lane_count(visible);
+        if (!visible) return 0;
+
+        if (Output::needs_barycentrics) {
+            vfloat bc_clip[3];
+            for (int i=0; i<3; i++) bc_clip[i] = (vfloat(e0[i]) + lane_ef[i])*inv_w[i];
+            const vfloat norm = vfloat(1.f)/(bc_clip[0] + bc_clip[1] + bc_clip[2]);
+            for (int i=0; i<3; i++) (bc_clip[i]*norm).store(bar[i]);
+        }
+        const int written = output.shade(x, y, visible, bar);
+        stats.shaded    += lane_count(visible);
+        stats.discarded += lane_count(visible) - lane_count(written);
+        float znew[SIMD_WIDTH];
+        frag_depth.store(znew);
+        for (int l=0; l<SIMD_WIDTH; l++) {
+            if (written>>l & 1) *zptr[l] = znew[l];
+        }
+        return written;
+    }
+
+    Output &output;
+    FrameTile &image;
+    float zw[3];           // depth of the vertices divided by the area, screen-space linear
+    vfloat lane_dz;        // depth increments across a span
+    vfloat inv_w[3], lane_ef[3];
+    vint lane_e[3];
+    vint lane_dx, lane_dy; // pixel offsets of the lanes
+    float bar[3][FRAGMENT_BATCH]; // lanes past SIMD_WIDTH are left at zero
+    RasterStats::Counters stats;
+};
+
+// The bounding box is walked in blocks aligned on the BLOCK_SIZE grid, each one is classified with the edge functions
+// evaluated at its corners: blocks outside of an edge are skipped, blocks inside all three edges are filled without
+// any coverage test, the rest is tested pixel by pixel. Blocks whose farthest stored depth is in front of the whole
+// triangle are rejected as well. Pixels are processed SIMD_WIDTH at a time, as 2x2 quads aligned on even coordinates.
+template <class Output> void rasterize(const TriangleSetup &t, Output &output, FrameTile &image) {
+    const int xmin = std::max(t.xmin, image.get_left());
+    const int ymin = std::max(t.ymin, image.get_top());
+    const int xmax = std::min(t.xmax, image.get_right() - 1);
+    const int ymax = std::min(t.ymax, image.get_bottom() - 1);
+    if (xmin>xmax || ymin>ymax) return;
+
+    SpanRasterizer<Output> raster(output, image);
+    const float inv_area = 1.f/t.area;
+    long long e_dx[3], e_dy[3];
+    float dzdx = 0, dzdy = 0, zmax = -std::numeric_limits<float>::max();
+    int lane_dx[SIMD_WIDTH], lane_dy[SIMD_WIDTH];
+    for (int l=0; l<SIMD_WIDTH; l++) {
+        lane_dx[l] = lane_x(l);
+        lane_dy[l] = lane_y(l);
+    }
+    raster.lane_dx = vint::load(lane_dx);
+    raster.lane_dy = vint::load(lane_dy);
+    for (int i=0; i<3; i++) {
+        e_dx[i] = t.A[i]*SUBPIXEL_ONE;
+        e_dy[i] = t.B[i]*SUBPIXEL_ONE;
+        int offsets[SIMD_WIDTH];
+        for (int l=0; l<SIMD_WIDTH; l++) offsets[l] = int(lane_dx[l]*e_dx[i] + lane_dy[l]*e_dy[i]);
+        raster.lane_e[i]  = vint::load(offsets);
+        raster.lane_ef[i] = vfloat(raster.lane_e[i]);
+        raster.inv_w[i]   = vfloat(t.inv_w[i]);
+        raster.zw[i]      = t.zw[i]*inv_area;
+        dzdx += e_dx[i]*raster.zw[i];
+        dzdy += e_dy[i]*raster.zw[i];
+        zmax  = std::max(zmax, t.zw[i]);
+    }
+    float lane_dz[SIMD_WIDTH];
+    for (int l=0; l<SIMD_WIDTH; l++) lane_dz[l] = lane_dx[l]*dzdx + lane_dy[l]*dzdy;
+    raster.lane_dz = vfloat::load(lane_dz);
+
+    for (int by=ymin - ymin%BLOCK_SIZE; by<=ymax; by+=BLOCK_SIZE) {
+        const int y0 = std::max(by, ymin), y1 = std::min(by+BLOCK_SIZE-1, ymax);
+        for (int bx=xmin - xmin%BLOCK_SIZE; bx<=xmax; bx+=BLOCK_SIZE) {
+            const int x0 = std::max(bx, xmin), x1 = std::min(bx+BLOCK_SIZE-1, xmax);
+            const int npixels = (x1-x0+1)*(y1-y0+1);
+            raster.stats.tested += npixels;
+            long long e_row[3];
+            bool inside = true, outside = false;
+            float zblock = 0; // depth plane at (x0,y0)
+            for (int i=0; i<3; i++) {
+                e_row[i] = e_dx[i]*x0 + e_dy[i]*y0 + t.C[i];
+                const long long emax = e_row[i] + std::max(0LL, e_dx[i])*(x1-x0) + std::max(0LL, e_dy[i])*(y1-y0);
+                const long long emin = e_row[i] + std::min(0LL, e_dx[i])*(x1-x0) + std::min(0LL, e_dy[i])*(y1-y0);
+                outside = outside || emax<0;
+                inside  = inside && emin>=0;
+                zblock += float(e_row[i])*raster.zw[i];
+            }
+            if (outside) {
+                raster.stats.block_rejected += npixels;
+                continue;
+            }
+            zblock += std::max(0.f, dzdx)*(x1-x0) + std::max(0.f, dzdy)*(y1-y0);
+            if (std::min(zmax, zblock)<image.get_coarse_z(bx, by)) {
+                raster.stats.coarse_rejected += npixels;
+                continue;
+            }
+            int written = 0;
+            const int qx = x0 & ~1, qy = y0 & ~1;
+            for (int i=0; i<3; i++) e_row[i] -= e_dx[i]*(x0-qx) + e_dy[i]*(y0-qy);
+            for (int y=qy; y<=y1; y+=2) {
+                long long e[3] = { e_row[0], e_row[1], e_row[2] };
+                for (int x=qx; x<=x1; x+=QUAD_SPAN) {
+                    written |= raster.span(x, y, x0, y0, x1, y1, e, inside);
+                    for (int i=0; i<3; i++) e[i] += QUAD_SPAN*e_dx[i];
+                }
+                for (int i=0; i<3; i++) e_row[i] += 2*e_dy[i];
+            }
+            if (written) image.update_coarse_z(bx, by);
+        }
+    }
+    raster_stats.add(raster.stats);
+}
+
+} // namespace raster
+
+template <class ShaderT> void rasterize(const Primitive &prim, ShaderT &shader, FrameTile &image) {
+    raster::ShaderOutput<ShaderT> output(shader, image);
+    if (prim.clipped) output.barmap = &prim.barmap;
+    raster::rasterize(prim.setup, output, image);
+}
+
+template <class ShaderT> void triangle(mat<4,3,float> &clipc, ShaderT &shader, FrameTile &image) {
+    Primitive prims[MAX_PRIMITIVES];
+    const int n = assemble(clipc, prims);
+    if (n) shader.setup();
+    for (int i=0; i<n; i++) rasterize(prims[i], shader, image);
+}
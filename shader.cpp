@@ -1,29 +1,68 @@
 #include "shader.h"
 #include "model.h"
+#include "rasterizer.h"
+#include "simd.h"
 #include <algorithm>
 
+namespace {
+
+// SIMD_WIDTH vectors at once, structure of arrays
+struct vvec3 {
+    vfloat x, y, z;
+};
+
+inline vvec3 broadcast(Vec3f v) { vvec3 r = { vfloat(v.x), vfloat(v.y), vfloat(v.z) }; return r; }
+inline vvec3 operator+(vvec3 a, vvec3 b) { vvec3 r = { a.x+b.x, a.y+b.y, a.z+b.z }; return r; }
+inline vvec3 operator-(vvec3 a, vvec3 b) { vvec3 r = { a.x-b.x, a.y-b.y, a.z-b.z }; return r; }
+inline vvec3 operator*(vvec3 a, vfloat s) { vvec3 r = { a.x*s, a.y*s, a.z*s }; return r; }
+inline vfloat dot(vvec3 a, vvec3 b) { return a.x*b.x + a.y*b.y + a.z*b.z; }
+inline vvec3 normalize(vvec3 a) { return a*(vfloat(1.f)/sqrt(dot(a, a))); }
+
+// values at the vertices weighted by the barycentric coordinates of each lane
+inline vfloat interpolate(const vec<3,float> &row, const vfloat bar[3]) {
+    return vfloat(row[0])*bar[0] + vfloat(row[1])*bar[1] + vfloat(row[2])*bar[2];
+}
+
+inline vvec3 interpolate(const mat<3,3,float> &m, const vfloat bar[3]) {
+    vvec3 r = { interpolate(m[0], bar), interpolate(m[1], bar), interpolate(m[2], bar) };
+    return r;
+}
+
+}
+
 Vec4f Shader::vertex(int iface, int nthvert)
 {
     varying_uv.set_col(nthvert, pModel->uv(iface, nthvert));
-    varying_nrm.set_col(nthvert, proj<3>((Projection*ModelView).invert_transpose()*embed<4>(pModel->normal(iface, nthvert), 0.f)));
-    Vec4f gl_Vertex = Projection*ModelView*embed<4>(pModel->vert(iface, nthvert));
+    varying_nrm.set_col(nthvert, pUniforms->mvp_it*pModel->normal(iface, nthvert));
+    Vec4f gl_Vertex = pClip ? (*pClip)[pModel->vert_index(iface, nthvert)] : pUniforms->mvp.point(pModel->vert(iface, nthvert));
     varying_tri.set_col(nthvert, gl_Vertex);
     return gl_Vertex;
 }
 
+void Shader::setup()
+{
+    mat<3,3,float> ndc_tri; // column-vectors
+    for (int i=0; i<3; i++) ndc_tri.set_col(i, proj<3>(varying_tri.col(i)/varying_tri.col(i)[3]));
+    const Vec3f e1 = ndc_tri.col(1)-ndc_tri.col(0);
+    const Vec3f e2 = ndc_tri.col(2)-ndc_tri.col(0);
+    // the gradient g of u satisfies e1*g = du1 and e2*g = du2, the solution in the triangle plane is
+    // (du1*cross(e2, n) + du2*cross(n, e1)) / |n|^2 with n = cross(e1, e2)
+    tri_nrm = cross(e1, e2);
+    const Vec3f a = cross(e2, tri_nrm)/(tri_nrm*tri_nrm);
+    const Vec3f b = cross(tri_nrm, e1)/(tri_nrm*tri_nrm);
+    tri_bu = a*(varying_uv[0][1]-varying_uv[0][0]) + b*(varying_uv[0][2]-varying_uv[0][0]);
+    tri_bv = a*(varying_uv[1][1]-varying_uv[1][0]) + b*(varying_uv[1][2]-varying_uv[1][0]);
+}
+
 bool Shader::fragment(Vec3f bar, TGAColor &color)
 {
     Vec3f bn = (varying_nrm*bar).normalize();
     Vec2f uv = varying_uv*bar;
-    mat<3,3,float> ndc_tri; // column-vectors
-    for (int i=0; i<3; i++) ndc_tri.set_col(i, proj<3>(varying_tri.col(i)/varying_tri.col(i)[3]));
-    mat<3,3,float> A;
-    A[0] = ndc_tri.col(1)-ndc_tri.col(0);
-    A[1] = ndc_tri.col(2)-ndc_tri.col(0);
-    A[2] = bn;
-    A = A.invert();
-    Vec3f bu = A*Vec3f(varying_uv[0][1]-varying_uv[0][0], varying_uv[0][2]-varying_uv[0][0], 0);
-    Vec3f bv = A*Vec3f(varying_uv[1][1]-varying_uv[1][0], varying_uv[1][2]-varying_uv[1][0], 0);
+    // the gradients are moved along the triangle normal until they are orthogonal to the interpolated normal,
+    // which solves [e1; e2; bn] * x = (du1, du2, 0) without inverting a matrix per pixel
+    const float k = 1.f/(bn*tri_nrm);
+    Vec3f bu = tri_bu - tri_nrm*((bn*tri_bu)*k);
+    Vec3f bv = tri_bv - tri_nrm*((bn*tri_bv)*k);
     mat<3,3,float> B;
     B.set_col(0, bu.normalize());
     B.set_col(1, bv.normalize());
@@ -31,13 +70,65 @@ bool Shader::fragment(Vec3f bar, TGAColor &color)
 
     Vec3f n = (B*pModel->normal(uv)).normalize();
 
-    float intensity = n*light_dir;
+    float intensity = n*pUniforms->light_dir;
     float diff = std::max<float>(0.f, intensity + 0.1 * pow(intensity, 10));
     color = TGAColor(255, 255, 255)*diff;
     return false;
 }
 
-void Shader::setLightDirection(Vec3f &direction)
+// same as fragment(), one SIMD_WIDTH group of lanes at a time; only the normal map is read lane by lane, decoded in SIMD
+int Shader::fragments(int mask, const float bar[3][FRAGMENT_BATCH], unsigned colors[FRAGMENT_BATCH])
 {
-    light_dir = proj<3>((Projection*ModelView*embed<4>(direction, 0.f))).normalize();
+    const vvec3 nrm = broadcast(tri_nrm);
+    const vvec3 tbu = broadcast(tri_bu);
+    const vvec3 tbv = broadcast(tri_bv);
+    const vvec3 light = broadcast(pUniforms->light_dir);
+    for (int base=0; base<FRAGMENT_BATCH; base+=SIMD_WIDTH) {
+        const int lanes = mask>>base & ((1<<SIMD_WIDTH)-1);
+        if (!lanes) continue;
+        const vfloat b[3] = { vfloat::load(bar[0]+base), vfloat::load(bar[1]+base), vfloat::load(bar[2]+base) };
+        const vvec3 bn = normalize(interpolate(varying_nrm, b));
+        const vfloat k = vfloat(1.f)/dot(bn, nrm);
+        const vvec3 bu = normalize(tbu - nrm*(dot(bn, tbu)*k));
+        const vvec3 bv = normalize(tbv - nrm*(dot(bn, tbv)*k));
+
+        // the helper lanes of the quads give the derivatives of uv
+        const vfloat vu = interpolate(varying_uv[0], b);
+        const vfloat vv = interpolate(varying_uv[1], b);
+        float u[SIMD_WIDTH], v[SIMD_WIDTH], dudx[SIMD_WIDTH], dvdx[SIMD_WIDTH], dudy[SIMD_WIDTH], dvdy[SIMD_WIDTH];
+        vu.store(u);
+        vv.store(v);
+        quad_dx(vu).store(dudx);
+        quad_dx(vv).store(dvdx);
+        quad_dy(vu).store(dudy);
+        quad_dy(vv).store(dvdy);
+        float p[2][SIMD_WIDTH] = {};
+        for (int l=0; l<SIMD_WIDTH; l++) {
+            if (!(lanes>>l & 1)) continue;
+            const Vec2f oct = pModel->packed_normal(Vec2f(u[l], v[l]), Vec2f(dudx[l], dvdx[l]), Vec2f(dudy[l], dvdy[l]));
+            p[0][l] = oct[0];
+            p[1][l] = oct[1];
+        }
+        // octahedral decode, the tangent-space normal needs no normalization of its own
+        const vfloat scale(2.f/255.f);
+        const vfloat tx = vfloat::load(p[0])*scale - vfloat(1.f);
+        const vfloat ty = vfloat::load(p[1])*scale - vfloat(1.f);
+        const vfloat tz = vfloat(1.f) - abs(tx) - abs(ty);
+        const vfloat fold = max(vfloat(0.f) - tz, 0.f);
+        const vvec3 n = normalize(bu*select(tx >= 0.f, tx - fold, tx + fold) + bv*select(ty >= 0.f, ty - fold, ty + fold) + bn*tz);
+
+        const vfloat intensity = dot(n, light);
+        const vfloat i2 = intensity*intensity;
+        const vfloat i4 = i2*i2;
+        const vfloat i8 = i4*i4;
+        const vfloat diff = min(max(intensity + vfloat(.1f)*i8*i2, 0.f), 1.f); // NaN in the unused lanes gives 0
+        int c[SIMD_WIDTH];
+        truncate(diff*vfloat(255.f)).store(c);
+        for (int l=0; l<SIMD_WIDTH; l++) {
+            if (lanes>>l & 1) colors[base+l] = unsigned(c[l])*0x01010101u; // gray, alpha scaled as well
+        }
+    }
+    return mask;
 }
+
+template void rasterize<Shader>(const Primitive &prim, Shader &shader, FrameTile &image);
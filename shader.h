@@ -3,15 +3,18 @@
 
 class Model;
 
-struct Shader : public IShader {
+struct Shader final : public IShader {
     mat<2,3,float> varying_uv;  // triangle uv coordinates, written by the vertex shader, read by the fragment shader
     mat<4,3,float> varying_tri; // triangle coordinates (clip coordinates), written by VS, read by FS
     mat<3,3,float> varying_nrm; // normal per vertex to be interpolated by FS
-    Vec3f light_dir;
+    Vec3f tri_nrm;              // normal of the triangle in ndc, written by setup
+    Vec3f tri_bu, tri_bv;       // gradients of u and v lying in the triangle plane, written by setup
+    const Uniforms *pUniforms = nullptr;
     Model *pModel = nullptr;
+    const Vec4fStream *pClip = nullptr; // clip coordinates of all the vertices of the model, transformed beforehand
 
     Vec4f vertex(int iface, int nthvert) override;
+    void setup() override;
     bool fragment(Vec3f bar, TGAColor &color) override;
-
-    void setLightDirection(Vec3f &direction);
+    int fragments(int mask, const float bar[3][FRAGMENT_BATCH], unsigned colors[FRAGMENT_BATCH]) override;
 };
@@ -0,0 +1,173 @@
+#pragma once
+
+// Thin wrappers over the SIMD registers used by the rasterizer and the shaders.
+// The width is picked at compile time: 8 lanes with AVX2, 4 lanes with SSE2,
+// and a portable 4-lane emulation everywhere else.
+// quad_dx and quad_dy difference the lanes across 2x2 quads laid out as (0,0) (1,0) (0,1) (1,1) in each group of
+// 4 lanes: a[1]-a[0] and a[3]-a[2] along x, a[2]-a[0] and a[3]-a[1] along y.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#endif
+
+#ifdef SIMD_AVX2
+const int SIMD_WIDTH = 8;
+#else
+const int SIMD_WIDTH = 4;
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////
+
+#if defined(SIMD_AVX2)
+
+struct vmask {
+    __m256 v;
+    vmask() : v(_mm256_setzero_ps()) {}
+    explicit vmask(__m256 m) : v(m) {}
+    int bits() const { return _mm256_movemask_ps(v); }
+};
+
+struct vint {
+    __m256i v;
+    vint() : v(_mm256_setzero_si256()) {}
+    vint(int a) : v(_mm256_set1_epi32(a)) {}
+    explicit vint(__m256i a) : v(a) {}
+    static vint load(const int *p) { return vint(_mm256_loadu_si256((const __m256i*)p)); }
+    void store(int *p) const { _mm256_storeu_si256((__m256i*)p, v); }
+};
+
+struct vfloat {
+    __m256 v;
+    vfloat() : v(_mm256_setzero_ps()) {}
+    vfloat(float a) : v(_mm256_set1_ps(a)) {}
+    explicit vfloat(__m256 a) : v(a) {}
+    explicit vfloat(vint a) : v(_mm256_cvtepi32_ps(a.v)) {}
+    static vfloat load(const float *p) { return vfloat(_mm256_loadu_ps(p)); }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+};
+
+inline vmask operator&(vmask a, vmask b) { return vmask(_mm256_and_ps(a.v, b.v)); }
+
+inline vint operator+(vint a, vint b)  { return vint(_mm256_add_epi32(a.v, b.v)); }
+inline vmask operator>=(vint a, vint b) { return vmask(_mm256_castsi256_ps(_mm256_xor_si256(_mm256_cmpgt_epi32(b.v, a.v), _mm256_set1_epi32(-1)))); }
+
+inline vfloat operator+(vfloat a, vfloat b) { return vfloat(_mm256_add_ps(a.v, b.v)); }
+inline vfloat operator-(vfloat a, vfloat b) { return vfloat(_mm256_sub_ps(a.v, b.v)); }
+inline vfloat operator*(vfloat a, vfloat b) { return vfloat(_mm256_mul_ps(a.v, b.v)); }
+inline vfloat operator/(vfloat a, vfloat b) { return vfloat(_mm256_div_ps(a.v, b.v)); }
+inline vmask operator>=(vfloat a, vfloat b) { return vmask(_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)); }
+inline vfloat select(vmask m, vfloat a, vfloat b) { return vfloat(_mm256_blendv_ps(b.v, a.v, m.v)); }
+inline vfloat min(vfloat a, vfloat b) { return vfloat(_mm256_min_ps(a.v, b.v)); }
+inline vfloat max(vfloat a, vfloat b) { return vfloat(_mm256_max_ps(a.v, b.v)); }
+inline vfloat sqrt(vfloat a)          { return vfloat(_mm256_sqrt_ps(a.v)); }
+inline vfloat abs(vfloat a)           { return vfloat(_mm256_andnot_ps(_mm256_set1_ps(-0.f), a.v)); }
+inline vint truncate(vfloat a)        { return vint(_mm256_cvttps_epi32(a.v)); }
+inline vfloat quad_dx(vfloat a) { return vfloat(_mm256_sub_ps(_mm256_permute_ps(a.v, 0xF5), _mm256_permute_ps(a.v, 0xA0))); }
+inline vfloat quad_dy(vfloat a) { return vfloat(_mm256_sub_ps(_mm256_permute_ps(a.v, 0xEE), _mm256_permute_ps(a.v, 0x44))); }
+
+#elif defined(SIMD_SSE2)
+
+struct vmask {
+    __m128 v;
+    vmask() : v(_mm_setzero_ps()) {}
+    explicit vmask(__m128 m) : v(m) {}
+    int bits() const { return _mm_movemask_ps(v); }
+};
+
+struct vint {
+    __m128i v;
+    vint() : v(_mm_setzero_si128()) {}
+    vint(int a) : v(_mm_set1_epi32(a)) {}
+    explicit vint(__m128i a) : v(a) {}
+    static vint load(const int *p) { return vint(_mm_loadu_si128((const __m128i*)p)); }
+    void store(int *p) const { _mm_storeu_si128((__m128i*)p, v); }
+};
+
+struct vfloat {
+    __m128 v;
+    vfloat() : v(_mm_setzero_ps()) {}
+    vfloat(float a) : v(_mm_set1_ps(a)) {}
+    explicit vfloat(__m128 a) : v(a) {}
+    explicit vfloat(vint a) : v(_mm_cvtepi32_ps(a.v)) {}
+    static vfloat load(const float *p) { return vfloat(_mm_loadu_ps(p)); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+};
+
+inline vmask operator&(vmask a, vmask b) { return vmask(_mm_and_ps(a.v, b.v)); }
+
+inline vint operator+(vint a, vint b)  { return vint(_mm_add_epi32(a.v, b.v)); }
+inline vmask operator>=(vint a, vint b) { return vmask(_mm_castsi128_ps(_mm_xor_si128(_mm_cmpgt_epi32(b.v, a.v), _mm_set1_epi32(-1)))); }
+
+inline vfloat operator+(vfloat a, vfloat b) { return vfloat(_mm_add_ps(a.v, b.v)); }
+inline vfloat operator-(vfloat a, vfloat b) { return vfloat(_mm_sub_ps(a.v, b.v)); }
+inline vfloat operator*(vfloat a, vfloat b) { return vfloat(_mm_mul_ps(a.v, b.v)); }
+inline vfloat operator/(vfloat a, vfloat b) { return vfloat(_mm_div_ps(a.v, b.v)); }
+inline vmask operator>=(vfloat a, vfloat b) { return vmask(_mm_cmpge_ps(a.v, b.v)); }
+inline vfloat select(vmask m, vfloat a, vfloat b) { return vfloat(_mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v))); }
+inline vfloat min(vfloat a, vfloat b) { return vfloat(_mm_min_ps(a.v, b.v)); }
+inline vfloat max(vfloat a, vfloat b) { return vfloat(_mm_max_ps(a.v, b.v)); }
+inline vfloat sqrt(vfloat a)          { return vfloat(_mm_sqrt_ps(a.v)); }
+inline vfloat abs(vfloat a)           { return vfloat(_mm_andnot_ps(_mm_set1_ps(-0.f), a.v)); }
+inline vint truncate(vfloat a)        { return vint(_mm_cvttps_epi32(a.v)); }
+inline vfloat quad_dx(vfloat a) { return vfloat(_mm_sub_ps(_mm_shuffle_ps(a.v, a.v, 0xF5), _mm_shuffle_ps(a.v, a.v, 0xA0))); }
+inline vfloat quad_dy(vfloat a) { return vfloat(_mm_sub_ps(_mm_shuffle_ps(a.v, a.v, 0xEE), _mm_shuffle_ps(a.v, a.v, 0x44))); }
+
+#else
+
+#include <cmath>
+
+struct vmask {
+    bool v[SIMD_WIDTH];
+    vmask() { for (int i=SIMD_WIDTH; i--; v[i]=false); }
+    int bits() const { int r=0; for (int i=SIMD_WIDTH; i--; r |= int(v[i])<<i); return r; }
+};
+
+struct vint {
+    int v[SIMD_WIDTH];
+    vint() { for (int i=SIMD_WIDTH; i--; v[i]=0); }
+    vint(int a) { for (int i=SIMD_WIDTH; i--; v[i]=a); }
+    static vint load(const int *p) { vint r; for (int i=SIMD_WIDTH; i--; r.v[i]=p[i]); return r; }
+    void store(int *p) const { for (int i=SIMD_WIDTH; i--; p[i]=v[i]); }
+};
+
+struct vfloat {
+    float v[SIMD_WIDTH];
+    vfloat() { for (int i=SIMD_WIDTH; i--; v[i]=0.f); }
+    vfloat(float a) { for (int i=SIMD_WIDTH; i--; v[i]=a); }
+    explicit vfloat(vint a) { for (int i=SIMD_WIDTH; i--; v[i]=float(a.v[i])); }
+    static vfloat load(const float *p) { vfloat r; for (int i=SIMD_WIDTH; i--; r.v[i]=p[i]); return r; }
+    void store(float *p) const { for (int i=SIMD_WIDTH; i--; p[i]=v[i]); }
+};
+
+inline vmask operator&(vmask a, vmask b) { for (int i=SIMD_WIDTH; i--; a.v[i] = a.v[i] && b.v[i]); return a; }
+
+inline vint operator+(vint a, vint b)   { for (int i=SIMD_WIDTH; i--; a.v[i]+=b.v[i]); return a; }
+inline vmask operator>=(vint a, vint b) { vmask r; for (int i=SIMD_WIDTH; i--; r.v[i] = a.v[i]>=b.v[i]); return r; }
+
+inline vfloat operator+(vfloat a, vfloat b) { for (int i=SIMD_WIDTH; i--; a.v[i]+=b.v[i]); return a; }
+inline vfloat operator-(vfloat a, vfloat b) { for (int i=SIMD_WIDTH; i--; a.v[i]-=b.v[i]); return a; }
+inline vfloat operator*(vfloat a, vfloat b) { for (int i=SIMD_WIDTH; i--; a.v[i]*=b.v[i]); return a; }
+inline vfloat operator/(vfloat a, vfloat b) { for (int i=SIMD_WIDTH; i--; a.v[i]/=b.v[i]); return a; }
+inline vmask operator>=(vfloat a, vfloat b) { vmask r; for (int i=SIMD_WIDTH; i--; r.v[i] = a.v[i]>=b.v[i]); return r; }
+inline vfloat select(vmask m, vfloat a, vfloat b) { for (int i=SIMD_WIDTH; i--; a.v[i] = m.v[i] ? a.v[i] : b.v[i]); return a; }
+inline vfloat min(vfloat a, vfloat b) { for (int i=SIMD_WIDTH; i--; a.v[i] = a.v[i]<b.v[i] ? a.v[i] : b.v[i]); return a; } // b if either is NaN, as minps
+inline vfloat max(vfloat a, vfloat b) { for (int i=SIMD_WIDTH; i--; a.v[i] = a.v[i]>b.v[i] ? a.v[i] : b.v[i]); return a; } // b if either is NaN, as maxps
+inline vfloat sqrt(vfloat a)          { for (int i=SIMD_WIDTH; i--; a.v[i] = std::sqrt(a.v[i])); return a; }
+inline vfloat abs(vfloat a)           { for (int i=SIMD_WIDTH; i--; a.v[i] = std::fabs(a.v[i])); return a; }
+inline vint truncate(vfloat a)        { vint r; for (int i=SIMD_WIDTH; i--; r.v[i] = int(a.v[i])); return r; }
+inline vfloat quad_dx(vfloat a) { vfloat r; for (int i=SIMD_WIDTH; i--; r.v[i] = a.v[i|1] - a.v[i&~1]); return r; }
+inline vfloat quad_dy(vfloat a) { vfloat r; for (int i=SIMD_WIDTH; i--; r.v[i] = a.v[i|2] - a.v[i&~2]); return r; }
+
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////
+
+inline int lane_count(int bits) { // number of lanes set in vmask::bits()
+    int n = 0;
+    for (; bits; bits &= bits-1) n++;
+    return n;
+}
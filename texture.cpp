@@ -0,0 +1,496 @@
+#include "texture.h"
+#include "threadpool.h"
+#include "simd.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+const int ROWS_PER_TASK = 64;  // levels smaller than that are built on the calling thread
+const int BLOCK_BYTES[] = {0, 8, 16}; // per compressed 4x4 block, indexed by Texture::Format
+const int CACHED_BLOCKS = 256; // decoded blocks kept per thread
+
+std::atomic<unsigned> last_texture_id(0);
+
+// decoded blocks, direct mapped on an 8x8 window of blocks so that neighbours never evict each other, for two
+// consecutive levels and two textures; the texture ids start at 1 so the empty entries never match
+struct DecodedBlock {
+    unsigned texture;
+    int level;
+    int block;
+    unsigned char texels[16][4];
+};
+
+thread_local DecodedBlock decode_cache[CACHED_BLOCKS];
+
+// the four channels of a texel as floats, blended in one register where there is SSE
+#if defined(SIMD_SSE2) || defined(SIMD_AVX2)
+struct Channels {
+    __m128 v;
+    explicit Channels(__m128 a) : v(a) {}
+    explicit Channels(const float *p) : v(_mm_loadu_ps(p)) {}
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+};
+
+// the bytes of word, lowest first
+inline Channels unpack(unsigned word)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bytes = _mm_cvtsi32_si128(int(word));
+    return Channels(_mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero)));
+}
+
+inline Channels operator+(Channels a, Channels b) { return Channels(_mm_add_ps(a.v, b.v)); }
+inline Channels operator*(Channels a, float w)    { return Channels(_mm_mul_ps(a.v, _mm_set1_ps(w))); }
+#else
+struct Channels {
+    float v[4];
+    Channels() {}
+    explicit Channels(const float *p) { for (int c = 0; c < 4; ++c) v[c] = p[c]; }
+    void store(float *p) const { for (int c = 0; c < 4; ++c) p[c] = v[c]; }
+};
+
+inline Channels unpack(unsigned word)
+{
+    Channels r;
+    for (int c = 0; c < 4; ++c) r.v[c] = float(word >> 8 * c & 255);
+    return r;
+}
+
+inline Channels operator+(Channels a, Channels b) { for (int c = 0; c < 4; ++c) a.v[c] += b.v[c]; return a; }
+inline Channels operator*(Channels a, float w)    { for (int c = 0; c < 4; ++c) a.v[c] *= w; return a; }
+#endif
+
+// texel as one word, the bytes past the channels being masked off
+inline unsigned read_texel(const unsigned char *p, unsigned mask)
+{
+    unsigned word;
+    std::memcpy(&word, p, 4);
+    return word & mask;
+}
+
+// a faster floor for the texel coordinates
+inline int floor_int(float x)
+{
+    const int i = int(x);
+    return i - (x < float(i));
+}
+
+inline int pack565(const unsigned char *bgra)
+{
+    return (bgra[2] >> 3) << 11 | (bgra[1] >> 2) << 5 | bgra[0] >> 3;
+}
+
+inline void unpack565(int c, unsigned char *bgra)
+{
+    const int r = c >> 11 & 31, g = c >> 5 & 63, b = c & 31;
+    bgra[0] = (unsigned char)(b << 3 | b >> 2);
+    bgra[1] = (unsigned char)(g << 2 | g >> 4);
+    bgra[2] = (unsigned char)(r << 3 | r >> 2);
+    bgra[3] = 255;
+}
+
+void bc1_palette(int c0, int c1, unsigned char palette[4][4])
+{
+    unpack565(c0, palette[0]);
+    unpack565(c1, palette[1]);
+    for (int c = 0; c < 4; ++c) {
+        if (c0 > c1) {
+            palette[2][c] = (unsigned char)((2 * palette[0][c] + palette[1][c]) / 3);
+            palette[3][c] = (unsigned char)((palette[0][c] + 2 * palette[1][c]) / 3);
+        } else {
+            palette[2][c] = (unsigned char)((palette[0][c] + palette[1][c]) / 2);
+            palette[3][c] = 0;
+        }
+    }
+}
+
+// The endpoints are the corners of the bounding box of the colors, along the diagonal that follows the correlation
+// of green and blue with red; every texel takes the nearest of the four colors of the palette.
+void encode_bc1(const unsigned char texels[16][4], unsigned char out[8])
+{
+    int lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0}, mean[3] = {0, 0, 0};
+    for (int i = 0; i < 16; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            lo[c] = std::min(lo[c], int(texels[i][c]));
+            hi[c] = std::max(hi[c], int(texels[i][c]));
+            mean[c] += texels[i][c];
+        }
+    }
+    int cov[2] = {0, 0}; // of blue and green with red
+    for (int i = 0; i < 16; ++i) {
+        const int r = texels[i][2] * 16 - mean[2];
+        cov[0] += (texels[i][0] * 16 - mean[0]) * r;
+        cov[1] += (texels[i][1] * 16 - mean[1]) * r;
+    }
+    unsigned char e0[4] = { (unsigned char)hi[0], (unsigned char)hi[1], (unsigned char)hi[2], 255 };
+    unsigned char e1[4] = { (unsigned char)lo[0], (unsigned char)lo[1], (unsigned char)lo[2], 255 };
+    for (int c = 0; c < 2; ++c) {
+        if (cov[c] < 0) std::swap(e0[c], e1[c]);
+    }
+    int c0 = pack565(e0), c1 = pack565(e1);
+    if (c0 < c1) std::swap(c0, c1); // keeps the four colors mode
+    unsigned char palette[4][4];
+    bc1_palette(c0, c1, palette);
+    unsigned indices = 0;
+    for (int i = 0; c0 != c1 && i < 16; ++i) {
+        int best = 0, bestDistance = 1 << 30;
+        for (int p = 0; p < 4; ++p) {
+            int distance = 0;
+            for (int c = 0; c < 3; ++c) distance += (texels[i][c] - palette[p][c]) * (texels[i][c] - palette[p][c]);
+            if (distance < bestDistance) {
+                bestDistance = distance;
+                best = p;
+            }
+        }
+        indices |= unsigned(best) << 2 * i;
+    }
+    out[0] = (unsigned char)c0;
+    out[1] = (unsigned char)(c0 >> 8);
+    out[2] = (unsigned char)c1;
+    out[3] = (unsigned char)(c1 >> 8);
+    for (int i = 0; i < 4; ++i) out[4 + i] = (unsigned char)(indices >> 8 * i);
+}
+
+void decode_bc1(const unsigned char in[8], unsigned char texels[16][4])
+{
+    unsigned char palette[4][4];
+    bc1_palette(in[0] | in[1] << 8, in[2] | in[3] << 8, palette);
+    const unsigned indices = in[4] | in[5] << 8 | in[6] << 16 | unsigned(in[7]) << 24;
+    for (int i = 0; i < 16; ++i) {
+        const unsigned char *p = palette[indices >> 2 * i & 3];
+        std::copy(p, p + 4, texels[i]);
+    }
+}
+
+void bc4_palette(int e0, int e1, int palette[8])
+{
+    palette[0] = e0;
+    palette[1] = e1;
+    if (e0 > e1) {
+        for (int i = 2; i < 8; ++i) palette[i] = ((8 - i) * e0 + (i - 1) * e1) / 7;
+    } else {
+        for (int i = 2; i < 6; ++i) palette[i] = ((6 - i) * e0 + (i - 1) * e1) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+// one channel of the block, the endpoints being its extrema
+void encode_bc4(const unsigned char texels[16][4], int channel, unsigned char out[8])
+{
+    int e0 = 0, e1 = 255;
+    for (int i = 0; i < 16; ++i) {
+        e0 = std::max(e0, int(texels[i][channel]));
+        e1 = std::min(e1, int(texels[i][channel]));
+    }
+    int palette[8];
+    bc4_palette(e0, e1, palette);
+    unsigned long long indices = 0;
+    for (int i = 0; e0 != e1 && i < 16; ++i) {
+        int best = 0;
+        for (int p = 1; p < 8; ++p) {
+            if (std::abs(palette[p] - texels[i][channel]) < std::abs(palette[best] - texels[i][channel])) best = p;
+        }
+        indices |= (unsigned long long)best << 3 * i;
+    }
+    out[0] = (unsigned char)e0;
+    out[1] = (unsigned char)e1;
+    for (int i = 0; i < 6; ++i) out[2 + i] = (unsigned char)(indices >> 8 * i);
+}
+
+void decode_bc4(const unsigned char in[8], int channel, unsigned char texels[16][4])
+{
+    int palette[8];
+    bc4_palette(in[0], in[1], palette);
+    unsigned long long indices = 0;
+    for (int i = 0; i < 6; ++i) indices |= (unsigned long long)in[2 + i] << 8 * i;
+    for (int i = 0; i < 16; ++i) texels[i][channel] = (unsigned char)palette[indices >> 3 * i & 7];
+}
+
+// two channels, the first two of the texels
+void encode_bc5(const unsigned char texels[16][4], unsigned char out[16])
+{
+    encode_bc4(texels, 0, out);
+    encode_bc4(texels, 1, out + 8);
+}
+
+void decode_bc5(const unsigned char in[16], unsigned char texels[16][4])
+{
+    decode_bc4(in, 0, texels);
+    decode_bc4(in + 8, 1, texels);
+}
+
+}
+
+Texture::Texture()
+    : m_levels()
+    , m_bytespp(0)
+    , m_format(RAW)
+    , m_wrap(CLAMP)
+    , m_id(++last_texture_id)
+{
+}
+
+void Texture::init(TGAImage &image, ThreadPool *pool, Format format)
+{
+    init(image.get_width(), image.get_height(), image.get_bytespp(), image.buffer(), pool, format);
+}
+
+void Texture::init(int width, int height, int bytespp, const unsigned char *texels, ThreadPool *pool, Format format)
+{
+    m_levels.clear();
+    m_bytespp = bytespp;
+    m_format = (format == BC1 && m_bytespp >= 3) || (format == BC5 && m_bytespp >= 2) ? format : RAW;
+    m_id = ++last_texture_id;
+    if (!texels || width <= 0 || height <= 0) {
+        return;
+    }
+    Level base;
+    base.resize(width, height, m_bytespp);
+    const unsigned char *src = texels;
+    for (int y = 0; y < base.height; ++y) {
+        for (int x = 0; x < base.width; ++x, src += m_bytespp) {
+            std::copy(src, src + m_bytespp, &base.data[base.offset(x, y) * m_bytespp]);
+        }
+    }
+    m_levels.push_back(base);
+
+    while (m_levels.back().width > 1 || m_levels.back().height > 1) {
+        Level level;
+        level.resize(std::max(m_levels.back().width / 2, 1), std::max(m_levels.back().height / 2, 1), m_bytespp);
+        m_levels.push_back(level);
+        const Level &src = m_levels[m_levels.size() - 2];
+        Level &dst = m_levels.back();
+        if (!pool || dst.height <= ROWS_PER_TASK) {
+            downsample(src, dst, m_bytespp, 0, dst.height);
+            continue;
+        }
+        for (int y = 0; y < dst.height; y += ROWS_PER_TASK) {
+            pool->runAsync(downsample, std::cref(src), std::ref(dst), m_bytespp, y, std::min(y + ROWS_PER_TASK, dst.height));
+        }
+        pool->wait(); // the next level reads this one
+    }
+
+    if (m_format == RAW) {
+        return;
+    }
+    for (auto &level : m_levels) {
+        Level blocks;
+        blocks.width = level.width;
+        blocks.height = level.height;
+        blocks.tilesX = (level.width + 3) / 4;
+        const int blocksY = (level.height + 3) / 4;
+        blocks.data.resize(blocks.tilesX * blocksY * BLOCK_BYTES[m_format]);
+        if (!pool || level.height <= ROWS_PER_TASK) {
+            compress(level, blocks, m_bytespp, m_format, 0, blocksY);
+        } else {
+            for (int by = 0; by < blocksY; by += ROWS_PER_TASK / 4) {
+                pool->runAsync(compress, std::cref(level), std::ref(blocks), m_bytespp, m_format, by, std::min(by + ROWS_PER_TASK / 4, blocksY));
+            }
+            pool->wait();
+        }
+        level.data.swap(blocks.data);
+        level.tilesX = blocks.tilesX;
+    }
+}
+
+int Texture::get_width() const
+{
+    return m_levels.empty() ? 0 : m_levels[0].width;
+}
+
+int Texture::get_height() const
+{
+    return m_levels.empty() ? 0 : m_levels[0].height;
+}
+
+int Texture::get_bytespp() const
+{
+    return m_bytespp;
+}
+
+int Texture::get_levels() const
+{
+    return int(m_levels.size());
+}
+
+size_t Texture::get_memory() const
+{
+    size_t bytes = 0;
+    for (auto const& level : m_levels) {
+        bytes += level.data.size();
+    }
+    return bytes;
+}
+
+void Texture::set_wrap(Wrap wrap)
+{
+    m_wrap = wrap;
+}
+
+TGAColor Texture::get(int x, int y) const
+{
+    if (m_levels.empty() || x < 0 || y < 0 || x >= m_levels[0].width || y >= m_levels[0].height) {
+        return TGAColor();
+    }
+    return TGAColor(texel(0, x, y), m_bytespp);
+}
+
+TGAColor Texture::nearest(Vec2f uv) const
+{
+    if (m_levels.empty()) {
+        return TGAColor();
+    }
+    const Level &level = m_levels[0];
+    const int x = address(floor_int(uv.x * level.width), level.width);
+    const int y = address(floor_int(uv.y * level.height), level.height);
+    return TGAColor(texel(0, x, y), m_bytespp);
+}
+
+int Texture::address(int c, int size) const
+{
+    if (m_wrap == CLAMP) {
+        return std::min(std::max(c, 0), size - 1);
+    }
+    if ((size & (size - 1)) == 0) {
+        return c & (size - 1);
+    }
+    c %= size;
+    return c < 0 ? c + size : c;
+}
+
+const unsigned char *Texture::texel(int level, int x, int y) const
+{
+    const Level &l = m_levels[level];
+    if (m_format == RAW) {
+        return &l.data[l.offset(x, y) * m_bytespp];
+    }
+    return decoded_texel(level, x, y);
+}
+
+const unsigned char *Texture::decoded_texel(int level, int x, int y) const
+{
+    const Level &l = m_levels[level];
+    const int block = (y >> 2) * l.tilesX + (x >> 2);
+    DecodedBlock &entry = decode_cache[(x >> 2 & 7) | (y >> 2 & 7) << 3 | (level & 1) << 6 | (m_id & 1) << 7];
+    if (entry.texture != m_id || entry.level != level || entry.block != block) {
+        const unsigned char *in = &l.data[block * BLOCK_BYTES[m_format]];
+        if (m_format == BC1) {
+            decode_bc1(in, entry.texels);
+        } else {
+            decode_bc5(in, entry.texels);
+        }
+        entry.texture = m_id;
+        entry.level = level;
+        entry.block = block;
+    }
+    return entry.texels[(y & 3) * 4 + (x & 3)];
+}
+
+float Texture::lod(Vec2f duvdx, Vec2f duvdy) const
+{
+    const Vec2f dx(duvdx.x * get_width(), duvdx.y * get_height());
+    const Vec2f dy(duvdy.x * get_width(), duvdy.y * get_height());
+    const float footprint = std::max(dx * dx, dy * dy);
+    return footprint > 0.f ? .5f * std::log2(footprint) : 0.f;
+}
+
+Vec4f Texture::sample(Vec2f uv, float lod) const
+{
+    if (m_levels.empty()) {
+        return Vec4f();
+    }
+    lod = std::min(std::max(lod, 0.f), float(m_levels.size() - 1));
+    const int level = int(lod);
+    const float t = lod - level;
+    Vec4f res;
+    bilinear(level, uv, 1.f - t, &res[0]);
+    if (t > 0.f) {
+        bilinear(level + 1, uv, t, &res[0]);
+    }
+    return res;
+}
+
+void Texture::Level::resize(int w, int h, int bytespp)
+{
+    width = w;
+    height = h;
+    tilesX = (w + TILE - 1) >> TILE_BITS;
+    const int tilesY = (h + TILE - 1) >> TILE_BITS;
+    data.assign(tilesX * tilesY * TILE * TILE * bytespp + 3, 0);
+}
+
+int Texture::Level::offset(int x, int y) const
+{
+    const int tile = (y >> TILE_BITS) * tilesX + (x >> TILE_BITS);
+    return (tile << 2 * TILE_BITS) + ((y & (TILE - 1)) << TILE_BITS) + (x & (TILE - 1));
+}
+
+// texel centers lie at half-integer coordinates
+void Texture::bilinear(int l, Vec2f uv, float weight, float res[4]) const
+{
+    const Level &level = m_levels[l];
+    const float x = uv.x * level.width - .5f, y = uv.y * level.height - .5f;
+    const int ix = floor_int(x), iy = floor_int(y);
+    const float fx = x - ix, fy = y - iy;
+    const int x0 = address(ix, level.width), x1 = address(ix + 1, level.width);
+    const int y0 = address(iy, level.height), y1 = address(iy + 1, level.height);
+    const unsigned mask = m_bytespp >= 4 ? ~0u : (1u << 8 * m_bytespp) - 1;
+    // a compressed fetch may evict the decoded block of the previous one, each texel is read before the next fetch
+    const unsigned t00 = read_texel(texel(l, x0, y0), mask);
+    const unsigned t10 = read_texel(texel(l, x1, y0), mask);
+    const unsigned t01 = read_texel(texel(l, x0, y1), mask);
+    const unsigned t11 = read_texel(texel(l, x1, y1), mask);
+    const float wy0 = (1.f - fy) * weight, wy1 = fy * weight;
+    const Channels sum = unpack(t00) * ((1.f - fx) * wy0) + unpack(t10) * (fx * wy0)
+                       + unpack(t01) * ((1.f - fx) * wy1) + unpack(t11) * (fx * wy1);
+    (Channels(res) + sum).store(res);
+}
+
+// rows [y0, y1) of dst, the last row and column of an odd sized level are folded into their neighbours
+void Texture::downsample(const Level &src, Level &dst, int bytespp, int y0, int y1)
+{
+    const int wx = src.width > 1 ? 2 : 1, wy = src.height > 1 ? 2 : 1;
+    for (int y = y0; y < y1; ++y) {
+        const int sy1 = (y == dst.height - 1) ? src.height : y * 2 + wy;
+        for (int x = 0; x < dst.width; ++x) {
+            const int sx1 = (x == dst.width - 1) ? src.width : x * 2 + wx;
+            int sum[4] = {0, 0, 0, 0};
+            int count = 0;
+            for (int sy = y * 2; sy < sy1; ++sy) {
+                for (int sx = x * 2; sx < sx1; ++sx) {
+                    const unsigned char *p = &src.data[src.offset(sx, sy) * bytespp];
+                    for (int c = 0; c < bytespp; ++c) sum[c] += p[c];
+                    ++count;
+                }
+            }
+            unsigned char *q = &dst.data[dst.offset(x, y) * bytespp];
+            for (int c = 0; c < bytespp; ++c) q[c] = (unsigned char)((sum[c] + count / 2) / count);
+        }
+    }
+}
+
+// block rows [by0, by1) of dst, the texels past the edges of the level repeat the last row and column
+void Texture::compress(const Level &src, Level &dst, int bytespp, Format format, int by0, int by1)
+{
+    unsigned char texels[16][4];
+    for (int by = by0; by < by1; ++by) {
+        for (int bx = 0; bx < dst.tilesX; ++bx) {
+            for (int i = 0; i < 16; ++i) {
+                const int x = std::min(bx * 4 + (i & 3), src.width - 1), y = std::min(by * 4 + (i >> 2), src.height - 1);
+                const unsigned char *p = &src.data[src.offset(x, y) * bytespp];
+                for (int c = 0; c < 4; ++c) texels[i][c] = c < bytespp ? p[c] : 255;
+            }
+            unsigned char *out = &dst.data[(bx + by * dst.tilesX) * BLOCK_BYTES[format]];
+            if (format == BC1) {
+                encode_bc1(texels, out);
+            } else {
+                encode_bc5(texels, out);
+            }
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+#include "tgaimage.h"
+
+class ThreadPool;
+
+// log2 of the side of the texel tiles, defining it to 0 at build time gives the row-linear layout
+#ifndef TEXTURE_TILE_BITS
+#define TEXTURE_TILE_BITS 2
+#endif
+
+// Texture map along with its mip chain: every level is a 2x2 box filtered copy of the previous one, down to 1x1.
+// Sampling at a level of detail matching the footprint of the pixels keeps far away surfaces from reading texels
+// scattered all over the full resolution image.
+// The texels are stored in square tiles, row by row within a tile, so that the neighbourhood of a texel shares its
+// cache lines whatever the direction the uv coordinates run in the screen.
+// The levels can also be held as 4x4 compressed blocks, decoded on the fly through a small per-thread cache:
+// BC1 keeps the colors at 4 bits per texel, BC5 keeps the first two channels at 8 bits per texel.
+class Texture
+{
+public:
+    static const int TILE_BITS = TEXTURE_TILE_BITS; // 4x4 texels per tile by default
+    static const int TILE = 1 << TILE_BITS;
+
+    enum Format {
+        RAW,
+        BC1,
+        BC5
+    };
+
+    // addressing of the coordinates outside of [0, 1]; power of two sizes repeat with a mask
+    enum Wrap {
+        CLAMP,
+        REPEAT
+    };
+
+    Texture();
+
+    // copies the image to the first level and builds the others, row ranges being spread over the pool if any
+    void init(TGAImage &image, ThreadPool *pool = nullptr, Format format = RAW);
+    void init(int width, int height, int bytespp, const unsigned char *texels, ThreadPool *pool = nullptr, Format format = RAW);
+
+    int get_width() const;
+    int get_height() const;
+    int get_bytespp() const;
+    int get_levels() const;
+    size_t get_memory() const; // bytes held by the levels
+    void set_wrap(Wrap wrap);
+
+    TGAColor get(int x, int y) const; // texel of the full resolution level, black outside of it
+    TGAColor nearest(Vec2f uv) const; // texel of the full resolution level under uv, addressed as by the wrap mode
+
+    // log2 of the footprint of a pixel in texels, duvdx and duvdy being the screen-space derivatives of uv
+    float lod(Vec2f duvdx, Vec2f duvdy) const;
+    // trilinear filtering, the coordinates are addressed as by the wrap mode; channels in the bgra order, from 0 to 255
+    Vec4f sample(Vec2f uv, float lod) const;
+
+private:
+    struct Level {
+        void resize(int w, int h, int bytespp); // with a few bytes of slack so that any texel reads as a 32-bit word
+        int offset(int x, int y) const; // of the texel (x, y), in texels
+
+        int width;
+        int height;
+        int tilesX;   // tiles per row of tiles, the last ones being padded; for compressed levels, blocks per row
+        std::vector<unsigned char> data;
+    };
+
+    static void downsample(const Level &src, Level &dst, int bytespp, int y0, int y1);
+    static void compress(const Level &src, Level &dst, int bytespp, Format format, int by0, int by1);
+    const unsigned char *texel(int level, int x, int y) const; // m_bytespp channels
+    const unsigned char *decoded_texel(int level, int x, int y) const; // through the decode cache, 4 channels
+    int address(int c, int size) const; // in [0, size), so that the texel reads need no bounds check
+    void bilinear(int level, Vec2f uv, float weight, float res[4]) const; // adds the filtered texel times weight
+
+    std::vector<Level> m_levels;
+    int m_bytespp;
+    Format m_format;
+    Wrap m_wrap;
+    unsigned m_id; // identifies the texture in the decode cache
+};
@@ -38,6 +38,14 @@ public:
         return true;
     }
 
+    void wait()
+    {
+        while (!IsEmpty())
+        {
+            this_thread::yield();
+        }
+    }
+
 private:
     worker_ptr getFreeWorker()
     {
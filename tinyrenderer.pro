@@ -2,6 +2,9 @@ CONFIG += c++11
 
 LIBS += -lSDL2
 
+# qmake CONFIG+=linear_textures stores the texels row by row, to compare with the tiled layout through --bench
+linear_textures: DEFINES += TEXTURE_TILE_BITS=0
+
 HEADERS += \
     geometry.h \
     model.h \
@@ -9,7 +12,13 @@ HEADERS += \
     tgaimage.h \
     sdlwindow.h \
     shader.h \
-    frametile.h
+    frametile.h \
+    simd.h \
+    depthbuffer.h \
+    binner.h \
+    rasterizer.h \
+    texture.h \
+    transform.h
 
 SOURCES += \
     geometry.cpp \
@@ -19,4 +28,8 @@ SOURCES += \
     tgaimage.cpp \
     sdlwindow.cpp \
     shader.cpp \
-    frametile.cpp
+    frametile.cpp \
+    depthbuffer.cpp \
+    binner.cpp \
+    texture.cpp \
+    transform.cpp
@@ -0,0 +1,66 @@
+#include "transform.h"
+
+Affine3::Affine3() : linear(mat<3,3,float>::identity()), translation() {}
+
+Affine3::Affine3(const mat<3,3,float> &linear, Vec3f translation) : linear(linear), translation(translation) {}
+
+Affine3 Affine3::inverse() const {
+    const mat<3,3,float> inv = linear.invert();
+    return Affine3(inv, Vec3f(0, 0, 0) - Vec3f(inv[0]*translation, inv[1]*translation, inv[2]*translation));
+}
+
+Matrix Affine3::matrix() const {
+    Matrix m = Matrix::identity();
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<3; j++) m[i][j] = linear[i][j];
+        m[i][3] = translation[i];
+    }
+    return m;
+}
+
+Affine3 operator*(const Affine3 &lhs, const Affine3 &rhs) {
+    return Affine3(lhs.linear*rhs.linear, lhs.point(rhs.translation));
+}
+
+Perspective::Perspective(float coeff) : coeff(coeff) {}
+
+Vec4f Perspective::point(const Vec3f &p) const {
+    Vec4f ret = embed<4>(p);
+    ret[3] = coeff*p.z + 1.f;
+    return ret;
+}
+
+Matrix Perspective::matrix() const {
+    Matrix m = Matrix::identity();
+    m[3][2] = coeff;
+    return m;
+}
+
+Matrix PerspectiveAffine::matrix() const {
+    return projection.matrix()*view.matrix();
+}
+
+PerspectiveAffine operator*(const Perspective &lhs, const Affine3 &rhs) {
+    PerspectiveAffine ret;
+    ret.view = rhs;
+    ret.projection = lhs;
+    return ret;
+}
+
+ViewportTransform::ViewportTransform() : scale(1.f, 1.f), offset(0.f, 0.f) {}
+
+Vec2f ViewportTransform::screen(const Vec4f &clip) const {
+    const float inv_w = 1.f/clip[3];
+    return Vec2f(scale.x*clip[0]*inv_w + offset.x, scale.y*clip[1]*inv_w + offset.y);
+}
+
+Matrix ViewportTransform::matrix() const {
+    Matrix m = Matrix::identity();
+    m[0][0] = scale.x;
+    m[1][1] = scale.y;
+    m[0][3] = offset.x;
+    m[1][3] = offset.y;
+    m[2][2] = 0.f;
+    m[2][3] = 1.f;
+    return m;
+}
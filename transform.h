@@ -0,0 +1,56 @@
+#pragma once
+
+#include "geometry.h"
+
+// Transforms that know their structure: composing them and moving points through them only touches the terms that
+// are not constant, where the equivalent 4x4 matrices, given by matrix(), would multiply out all the zeros and ones.
+
+// linear part followed by a translation, the last row being (0, 0, 0, 1)
+struct Affine3 {
+    Affine3(); // identity
+    Affine3(const mat<3,3,float> &linear, Vec3f translation);
+
+    Vec3f point(const Vec3f &p) const { return vector(p) + translation; }
+    Vec3f vector(const Vec3f &v) const { return Vec3f(linear[0]*v, linear[1]*v, linear[2]*v); }
+
+    Affine3 inverse() const;
+    Matrix matrix() const;
+
+    mat<3,3,float> linear;
+    Vec3f translation;
+};
+
+Affine3 operator*(const Affine3 &lhs, const Affine3 &rhs);
+
+// the projection of our_gl: the identity but for w = coeff*z + 1, coeff = -1/c
+struct Perspective {
+    explicit Perspective(float coeff = 0.f);
+
+    Vec4f point(const Vec3f &p) const;
+    Matrix matrix() const;
+
+    float coeff;
+};
+
+// a perspective applied after an affine transform, as Projection*ModelView
+struct PerspectiveAffine {
+    Vec4f point(const Vec3f &p) const { return projection.point(view.point(p)); }
+    Vec3f vector(const Vec3f &v) const { return view.vector(v); } // the perspective leaves the directions alone
+    Matrix matrix() const;
+
+    Affine3 view;
+    Perspective projection;
+};
+
+PerspectiveAffine operator*(const Perspective &lhs, const Affine3 &rhs);
+
+// maps the normalized device coordinates x and y to the screen with a scale and an offset, z gets w
+struct ViewportTransform {
+    ViewportTransform(); // identity on x and y
+
+    Vec2f screen(const Vec4f &clip) const; // x and y of a point given in clip coordinates, after the division by w
+    Matrix matrix() const;
+
+    Vec2f scale;
+    Vec2f offset;
+};